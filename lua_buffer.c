@@ -0,0 +1,256 @@
+/* lua_buffer.c
+ *
+ * Byte buffer shared by the Lua bindings for Tox.
+ *
+ *  Copyright (C) 2014 Peersuasive Technologies All Rights Reserved.
+ *
+ *  This file is part of LuaTox.
+ *
+ *  LuaTox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  LuaTox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with LuaTox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/**
+ * a fixed capacity byte buffer, accepted wherever the bindings take a data string
+ * and filled in place by the methods that can return data into it,
+ * so that large transfers can reuse a few buffers instead of creating strings
+ * slices share the memory of the buffer they're taken from
+ */
+
+#include <stdlib.h> // malloc
+#include <string.h> // memcpy, memmove
+#include "lua_buffer.h"
+
+LToxBuffer *push_buffer(lua_State *L, size_t capacity) {
+    LToxBuffer *b = (LToxBuffer*)lua_newuserdata(L, sizeof(LToxBuffer));
+    b->len = 0;
+    b->capacity = 0;
+    b->owner = LUA_NOREF;
+    b->data = NULL;
+    luaL_getmetatable(L, TOX_BUFFER_STR);
+    lua_setmetatable(L, -2);
+    if(capacity) {
+        b->data = (uint8_t*)malloc(capacity);
+        if(!b->data)
+            luaL_error(L, "Can't allocate buffer of %d bytes.", (int)capacity);
+        b->capacity = capacity;
+    }
+    return b;
+}
+
+// NULL if the value at index isn't a buffer
+LToxBuffer *test_buffer(lua_State *L, int index) {
+    LToxBuffer *b = (LToxBuffer*)lua_touserdata(L, index);
+    if(b == NULL || !lua_getmetatable(L, index))
+        return NULL;
+    luaL_getmetatable(L, TOX_BUFFER_STR);
+    int is_buffer = lua_rawequal(L, -1, -2);
+    lua_pop(L,2);
+    return is_buffer ? b : NULL;
+}
+
+LToxBuffer *check_buffer(lua_State *L, int index) {
+    LToxBuffer *b = test_buffer(L, index);
+    if(b == NULL)
+        luaL_typerror(L, index, TOX_BUFFER_STR);
+    return b;
+}
+
+// string or buffer at index, the value must stay on the stack while the data is used
+const uint8_t *check_data(lua_State *L, int index, size_t *len) {
+    LToxBuffer *b = test_buffer(L, index);
+    if(b) {
+        *len = b->len;
+        return b->data;
+    }
+    return (const uint8_t*)luaL_checklstring(L, index, len);
+}
+
+// same as check_data, NULL for none or nil
+const uint8_t *opt_data(lua_State *L, int index, size_t *len) {
+    LToxBuffer *b = test_buffer(L, index);
+    if(b) {
+        *len = b->len;
+        return b->data;
+    }
+    *len = 0;
+    return (const uint8_t*)lua_tolstring(L, index, len);
+}
+
+// replaces the content of the buffer, returns 0 if it doesn't fit
+int buffer_set(LToxBuffer *b, const void *data, size_t len) {
+    if(len > b->capacity)
+        return 0;
+    if(len)
+        memmove(b->data, data, len);
+    b->len = len;
+    return 1;
+}
+
+// converts Lua positions i, j to a 0-based range of b, string.sub style
+static size_t buffer_range(lua_State *L, LToxBuffer *b, int i_index, size_t *count) {
+    lua_Number i = luaL_optnumber(L, i_index, 1);
+    lua_Number j = luaL_optnumber(L, i_index+1, -1);
+    lua_Number len = (lua_Number)b->len;
+    if(i < 0) i = len + i + 1;
+    if(j < 0) j = len + j + 1;
+    if(i < 1) i = 1;
+    if(j > len) j = len;
+    *count = (i > j) ? 0 : (size_t)(j - i + 1);
+    return (size_t)i - 1;
+}
+
+// Tox.buffer(capacity)
+int lua_buffer_new(lua_State *L) {
+    int index = (lua_type(L,1) == LUA_TNUMBER) ? 1 : 2; // Tox.buffer(n) or tox:buffer(n)
+    lua_Number capacity = luaL_checknumber(L, index);
+    luaL_argcheck(L, capacity >= 0, index, "capacity can't be negative");
+    lua_settop(L,0);
+    push_buffer(L, (size_t)capacity);
+    return 1;
+}
+
+static int lua_buffer_gc(lua_State *L) {
+    LToxBuffer *b = check_buffer(L,1);
+    if(b->owner == LUA_NOREF)
+        free(b->data);
+    else
+        luaL_unref(L, LUA_REGISTRYINDEX, b->owner);
+    b->data = NULL;
+    b->owner = LUA_NOREF;
+    b->len = b->capacity = 0;
+    return 0;
+}
+
+static int lua_buffer_capacity(lua_State *L) {
+    LToxBuffer *b = check_buffer(L,1);
+    lua_settop(L,0);
+    lua_pushnumber(L, b->capacity);
+    return 1;
+}
+
+static int lua_buffer_len(lua_State *L) {
+    LToxBuffer *b = check_buffer(L,1);
+    lua_settop(L,0);
+    lua_pushnumber(L, b->len);
+    return 1;
+}
+
+static int lua_buffer_set_length(lua_State *L) {
+    LToxBuffer *b = check_buffer(L,1);
+    lua_Number len = luaL_checknumber(L,2);
+    luaL_argcheck(L, len >= 0 && len <= b->capacity, 2, "length out of capacity");
+    b->len = (size_t)len;
+    lua_settop(L,0);
+    return 0;
+}
+
+static int lua_buffer_clear(lua_State *L) {
+    LToxBuffer *b = check_buffer(L,1);
+    b->len = 0;
+    lua_settop(L,0);
+    return 0;
+}
+
+// buf:write(data [, offset]) copies a string or a buffer at offset, after the content by default
+// returns the new length, or nil and an error if the data doesn't fit
+static int lua_buffer_write(lua_State *L) {
+    LToxBuffer *b = check_buffer(L,1);
+    size_t len;
+    const uint8_t *data = check_data(L, 2, &len);
+    lua_Number offset = luaL_optnumber(L, 3, (lua_Number)b->len + 1);
+    luaL_argcheck(L, offset >= 1 && offset <= (lua_Number)b->len + 1, 3, "offset out of range");
+    size_t start = (size_t)offset - 1;
+    if(start + len > b->capacity) {
+        lua_settop(L,0);
+        lua_pushnil(L);
+        lua_pushliteral(L, "Buffer is too small.");
+        return 2;
+    }
+    if(len)
+        memmove(b->data + start, data, len);
+    if(start + len > b->len)
+        b->len = start + len;
+    lua_settop(L,0);
+    lua_pushnumber(L, b->len);
+    return 1;
+}
+
+// buf:slice(i [, j]) returns a buffer sharing the bytes i to j, string.sub style
+// no alignment is kept: a slice passed as 16 bits samples must start at an odd position
+static int lua_buffer_slice(lua_State *L) {
+    LToxBuffer *b = check_buffer(L,1);
+    size_t count;
+    size_t start = buffer_range(L, b, 2, &count);
+    lua_settop(L,1);
+
+    LToxBuffer *s = push_buffer(L, 0);
+    s->data = count ? b->data + start : NULL;
+    s->len = count;
+    s->capacity = count;
+    lua_pushvalue(L,1);
+    s->owner = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+// buf:tostring([i [, j]])
+static int lua_buffer_tostring(lua_State *L) {
+    LToxBuffer *b = check_buffer(L,1);
+    size_t count;
+    size_t start = buffer_range(L, b, 2, &count);
+    lua_settop(L,0);
+    lua_pushlstring(L, count ? (const char*)b->data + start : "", count);
+    return 1;
+}
+
+static const luaL_Reg buffer_methods[] = {
+    {"capacity", lua_buffer_capacity},
+    {"len", lua_buffer_len},
+    {"setLength", lua_buffer_set_length},
+    {"clear", lua_buffer_clear},
+    {"write", lua_buffer_write},
+    {"slice", lua_buffer_slice},
+    {"tostring", lua_buffer_tostring},
+    {NULL,NULL}
+};
+
+// kept out of the methods, so that Lua can't free the memory of live slices with buf:__gc()
+static const luaL_Reg buffer_meta[] = {
+    {"__len", lua_buffer_len},
+    {"__tostring", lua_buffer_tostring},
+    {"__gc", lua_buffer_gc},
+    {NULL,NULL}
+};
+
+// creates the buffer metatable, once for all the modules sharing the state
+void register_buffer(lua_State *L) {
+    if(!luaL_newmetatable(L, TOX_BUFFER_STR)) {
+        lua_pop(L,1);
+        return;
+    }
+    for(int f = 0; buffer_meta[f].name != NULL; ++f) {
+        lua_pushstring(L, buffer_meta[f].name);
+        lua_pushcclosure(L, buffer_meta[f].func, 0);
+        lua_settable(L, -3);
+    }
+    lua_pushliteral(L, "__index");
+    lua_newtable(L);
+    for(int f = 0; buffer_methods[f].name != NULL; ++f) {
+        lua_pushstring(L, buffer_methods[f].name);
+        lua_pushcclosure(L, buffer_methods[f].func, 0);
+        lua_settable(L, -3);
+    }
+    lua_rawset(L, -3);
+    lua_pop(L,1);
+}
@@ -0,0 +1,49 @@
+/* lua_buffer.h
+ *
+ * Byte buffer shared by the Lua bindings for Tox.
+ *
+ *  Copyright (C) 2014 Peersuasive Technologies All Rights Reserved.
+ *
+ *  This file is part of LuaTox.
+ *
+ *  LuaTox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  LuaTox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with LuaTox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LUA_TOX_BUFFER_H
+#define LUA_TOX_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lua.h"
+#include "lauxlib.h"
+
+#define TOX_BUFFER_STR "ToxBuffer"
+typedef struct _LToxBuffer {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+    int owner;          // luaL_ref of the buffer a slice points into, LUA_NOREF if data is owned
+} LToxBuffer;
+
+LToxBuffer *push_buffer(lua_State*, size_t capacity);
+LToxBuffer *test_buffer(lua_State*, int index);
+LToxBuffer *check_buffer(lua_State*, int index);
+const uint8_t *check_data(lua_State*, int index, size_t *len);
+const uint8_t *opt_data(lua_State*, int index, size_t *len);
+int buffer_set(LToxBuffer*, const void *data, size_t len);
+void register_buffer(lua_State*);
+int lua_buffer_new(lua_State*);
+
+#endif // LUA_TOX_BUFFER_H
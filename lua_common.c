@@ -1,5 +1,11 @@
 #include <stdlib.h>
 #include "lua_common.h"
+#include "tox/tox.h"
+
+#ifdef LUATOX_WITH_INTERNALS
+// toxcore has no public accessor for its sockets
+#include "toxcore/Messenger.h"
+#endif
 
 #if LUA_VERSION_NUM > 501
 int luaL_typerror (lua_State *L, int narg, const char *tname) {
@@ -163,3 +169,88 @@ int call_cb(lua_State *L, const void* key, const char *name, int nb_ret, int nb_
     }
     return status;
 }
+
+// same as call_cb, with the function held by a registry reference
+int call_ref(lua_State *L, int ref, const char *name, int nb_ret, int nb_args) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    // move function on top
+    lua_insert(L, -(nb_args+1));
+
+    int status = 0;
+    if ( ! (status = ! lua_pcall(L, nb_args, nb_ret, 0)) ) {
+        const char *msg = lua_tostring(L,-1);
+        lua_pushfstring(L, "Failed to execute callback '%s': %s", name, msg);
+        lua_error(L);
+    }
+    return status;
+}
+
+// returns the main thread of L's state, which callbacks run on
+// lua 5.1 has no way to get it back, so it is kept the first time we run on it,
+// NULL is returned while it is unknown
+lua_State *main_thread(lua_State *L) {
+#if LUA_VERSION_NUM > 501
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    lua_State *M = lua_tothread(L, -1);
+    lua_pop(L,1);
+    return M;
+#else
+    lua_getfield(L, LUA_REGISTRYINDEX, "luatox.mainthread");
+    lua_State *M = lua_tothread(L, -1);
+    lua_pop(L,1);
+    if(M == NULL) {
+        if(lua_pushthread(L)) { // L is the main thread
+            lua_setfield(L, LUA_REGISTRYINDEX, "luatox.mainthread");
+            M = L;
+        } else
+            lua_pop(L,1);
+    }
+    return M;
+#endif
+}
+
+// resumes co with the nb_args values on top of its stack
+int resume_thread(lua_State *L, lua_State *co, int nb_args) {
+#if LUA_VERSION_NUM > 501
+    return lua_resume(co, L, nb_args);
+#else
+    (void)L;
+    return lua_resume(co, nb_args);
+#endif
+}
+
+// friend numbers are below this bound, -1 if it can't be known
+int64_t friend_number_bound(void *tox) {
+#ifdef LUATOX_WITH_INTERNALS
+    return ((Messenger*)tox)->numfriends;
+#else
+    return -1;
+#endif
+}
+
+// push an array with the sockets used by tox
+int push_pollfds(lua_State *L, void *tox) {
+#ifdef LUATOX_WITH_INTERNALS
+    Messenger *m = (Messenger*)tox;
+    lua_newtable(L);
+    int n = 0;
+    if(m->net) {
+        lua_pushnumber(L, m->net->sock);
+        lua_rawseti(L, -2, ++n);
+    }
+    if(m->net_crypto) {
+        for(int i=0;i<MAX_TCP_CONNECTIONS;++i) {
+            TCP_Client_Connection *c = m->net_crypto->tcp_connections[i];
+            if(c) {
+                lua_pushnumber(L, c->sock);
+                lua_rawseti(L, -2, ++n);
+            }
+        }
+    }
+    return 1;
+#else
+    lua_pushnil(L);
+    lua_pushliteral(L, "pollfds: not supported by this build (needs LUATOX_WITH_INTERNALS).");
+    return 2;
+#endif
+}
@@ -24,12 +24,14 @@
 #ifndef LUA_TOX_COMMON_H
 #define LUA_TOX_COMMON_H
 
+#include <stdint.h>
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
 
 #if LUA_VERSION_NUM > 501
 int luaL_typerror (lua_State *L, int narg, const char *tname);
+#define lua_objlen lua_rawlen
 #endif
 
 void reg(lua_State*, const void*);
@@ -41,7 +43,10 @@ int store(lua_State*, const void* key, const char* name, void *data);
 int retrieve(lua_State*, const void* key, const char* name);
 void unref(lua_State* L, const void* key, const char* name);
 int call_cb(lua_State*, const void*, const char *name, int nb_ret, int nb_args);
-
-lua_State *Ls;
+int call_ref(lua_State*, int ref, const char *name, int nb_ret, int nb_args);
+int resume_thread(lua_State*, lua_State *co, int nb_args);
+int push_pollfds(lua_State*, void *tox);
+int64_t friend_number_bound(void *tox);
+lua_State *main_thread(lua_State*);
 
 #endif // LUA_TOX_COMMON_H
@@ -23,8 +23,16 @@
 
 #include <stdlib.h> // malloc
 #include <string.h> // strcat, strlen, memcpy
+#include <errno.h>  // EINTR
+#include <time.h>   // clock_gettime, clock_nanosleep
+#include <stdio.h>  // rename
+#include <fcntl.h>  // open
+#include <unistd.h> // write, fsync, close, unlink
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
 
 #include "lua_tox.h"
+#include "lua_buffer.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -123,6 +131,71 @@ static int checkToxOptions(lua_State* L, int index, Tox_Options *op) {
 }
 
 
+typedef struct _RunOptions {
+    int until;              // stack index of the stop predicate, 0 if none
+    long max_iterations;    // 0 means no limit
+} RunOptions;
+
+static int checkRunOptions(lua_State* L, int index, RunOptions *op) {
+    op->until = 0;
+    op->max_iterations = 0;
+
+    if (lua_gettop(L) < index || lua_isnil(L, index))
+        return 0;   /* Default options */
+
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    // 'until' is a reserved word: use { ["until"] = fn }
+    lua_getfield(L, index, "until");
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isfunction(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushstring(L, "Option 'until' must be a function");
+            return lua_error(L);
+        }
+        op->until = lua_gettop(L); // left on the stack for the loop
+    }
+    else
+        lua_pop(L, 1);
+
+    lua_getfield(L, index, "maxIterations");
+    if (!lua_isnil(L, -1)) {
+        if (lua_type(L, -1) != LUA_TNUMBER) {
+            lua_pop(L, 1);
+            lua_pushstring(L, "Option 'maxIterations' must be an integer");
+            return lua_error(L);
+        }
+        op->max_iterations = (long)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+
+    return 0;   /* ok */
+}
+
+/* monotonic time in nanoseconds */
+static uint64_t ltox_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ltox_sleep_until(uint64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+// calls the stop predicate, returns its result
+static int ltox_run_until(lua_State* L, int index) {
+    lua_pushvalue(L, index);
+    lua_call(L, 0, 1);
+    int r = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return r;
+}
+
 static Tox *toTox(lua_State* L, int index) {
     Tox *tox = (Tox*)lua_touserdata(L, index);
     if(tox==NULL)
@@ -136,6 +209,8 @@ static Tox *checkTox(lua_State* L, int index) {
     Tox *tox = ltox->tox;
     if(tox==NULL)
         luaL_typerror(L, index, TOX_STR);
+    if(ltox->thread)
+        luaL_error(L, "Tox instance is owned by its network thread, use post or stopThread.");
     return tox;
 }
 static LTox *checkLTox(lua_State* L, int index) {
@@ -145,9 +220,20 @@ static LTox *checkLTox(lua_State* L, int index) {
         luaL_typerror(L, index, TOX_STR);
     return ltox;
 }
+// same as checkLTox, for the methods that run tox itself
+static LTox *checkOwnedLTox(lua_State* L, int index) {
+    LTox *ltox = checkLTox(L, index);
+    if(ltox->thread)
+        luaL_error(L, "Tox instance is owned by its network thread, use post or stopThread.");
+    return ltox;
+}
 
 static LTox *pushTox(lua_State* L, Tox_Options *op) {
+    lua_State *M = main_thread(L);
+    if(M == NULL)
+        luaL_error(L, "Main thread unknown, create the first instance from it.");
     LTox *ltox = (LTox*)lua_newuserdata(L, sizeof(LTox));
+    ltox->L = M;
     ltox->tox = tox_new(op);
     if(ltox->tox==NULL) {
         lua_pushliteral(L, "Can't create new tox!");
@@ -251,476 +337,1449 @@ int throw_error(lua_State *L, int32_t err) {
  *                        *
  **************************/
 
-typedef struct _lobj {
-    LTox *ltox;
-    void *userdata;
-    size_t len;
-} LObj;
-LObj *createUserdata(lua_State *L, LTox *ltox, void *userdata, size_t len) {
-    LObj *l = (LObj*)malloc(sizeof(LObj));
-    l->userdata = userdata;
-    l->ltox = ltox;
-    l->len = len;
-
-    lua_pushlightuserdata(L, (void*)ltox->tox); // must exist, being registered with _new
-    lua_gettable(L, LUA_REGISTRYINDEX);
-    if (lua_isnil(L,-1))
-        luaL_error(L, "Can't get object table from registry -- not reg'ed ?");
-
-    lua_getfield(L, -1, "userdata");
-    if ( lua_isnil(L, -1) ) { // create new table
-        lua_pop(L,1); // nil
-        lua_createtable(L,0,20);
-        lua_setfield(L, -2, "userdata");
-        lua_getfield(L, -1, "userdata");
-    }
-    lua_pushlightuserdata(L, (void*)l);
-    lua_pushlightuserdata(L, (void*)l);
-    lua_settable(L,-3);
-    lua_pop(L,2); // table + registry
-    return l;
-}
+static const char *callback_names[] = {
+    "friend_request",
+    "friend_message",
+    "friend_action",
+    "name_change",
+    "status_message",
+    "user_status",
+    "typing_change",
+    "read_receipt",
+    "connection_status",
+    "group_invite",
+    "group_message",
+    "group_action",
+    "group_namelist_change",
+    "file_send_request",
+    "file_control",
+    "file_data",
+    NULL
+};
 
-void on_friend_request(Tox *tox, const uint8_t *public_key, const uint8_t *data, uint16_t length, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.friend_request) {
-        lua_pushlstring(Ls, (const char*)public_key, TOX_CLIENT_ID_SIZE);
-        lua_pushlstring(Ls, (const char*)data, length);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "friend_request", 0, 3);
-    }
-}
-int lua_tox_callback_friend_request(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "friend_request", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if(! lua_isnoneornil(L,3))
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
+// commands accepted by the network thread
+enum command_n {
+    CMD_SEND_MESSAGE,
+    CMD_SEND_ACTION,
+    CMD_FILE_SEND_DATA,
+    CMD_ADD_FRIEND,
+    CMD_ADD_FRIEND_NOREQUEST,
+};
+static const char *command_names[] = {
+    "sendMessage",
+    "sendAction",
+    "fileSendData",
+    "addFriend",
+    "addFriendNorequest",
+    NULL
+};
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+// batched event carrying the result of a command
+#define EV_COMMAND CB_MAX
 
-    ltox->callbacks.friend_request = 1;
-    tox_callback_friend_request(ltox->tox, on_friend_request, lobj);
-    return 0;
+// rings are indexed by masking free running counters, which stays right across their wraparound
+// only with a power of 2 capacity
+static uint32_t ring_capacity(uint32_t capacity) {
+    uint32_t n = 1;
+    while(n < capacity && n < (1U << 31))
+        n <<= 1;
+    return n;
 }
 
-void on_friend_message(Tox *tox, int32_t friendnumber, const uint8_t *message, uint16_t length, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.friend_message) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushlstring(Ls, (const char*)message, length);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "friend_message", 0, 3);
-    }
+/**
+ * batched delivery: when enabled, events are stored in a ring buffer
+ * and handed to Lua by drainEvents instead of calling the handlers
+ * payload buffers are kept with their slot and reused
+ * head and tail are accessed atomically, the producer being the network thread
+ * when the threaded engine is running
+ */
+static LToxEvents *events_new(uint32_t capacity) {
+    capacity = ring_capacity(capacity);
+    LToxEvents *q = (LToxEvents*)malloc(sizeof(LToxEvents));
+    q->slots = (LToxEvent*)calloc(capacity, sizeof(LToxEvent));
+    q->capacity = capacity;
+    q->head = 0;
+    q->tail = 0;
+    q->dropped = 0;
+    return q;
 }
-int lua_tox_callback_friend_message(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "friend_message", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
-
-    ltox->callbacks.friend_message = 1;
-    tox_callback_friend_message(ltox->tox, on_friend_message, lobj);
-    return 0;
+static void events_free(LToxEvents *q) {
+    if(!q)
+        return;
+    for(uint32_t i=0;i<q->capacity;++i)
+        free(q->slots[i].data);
+    free(q->slots);
+    free(q);
 }
 
-void on_friend_action(Tox *tox, int32_t friendnumber, const uint8_t *action, uint16_t length, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.friend_action) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushlstring(Ls, (const char*)action, length);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "friend_action", 0, 3);
+// next free slot, NULL if full
+static LToxEvent *events_reserve(LToxEvents *q, int type) {
+    if(q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= q->capacity) {
+        __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
     }
+    LToxEvent *ev = &q->slots[q->tail & (q->capacity - 1)];
+    ev->type = type;
+    ev->value = 0;
+    ev->len = 0;
+    return ev;
 }
-int lua_tox_callback_friend_action(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "friend_action", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+// copies the payload and publishes the reserved slot
+static void events_commit(LToxEvents *q, LToxEvent *ev, const uint8_t *data, uint32_t len) {
+    if(len > ev->size) {
+        uint8_t *p = (uint8_t*)realloc(ev->data, len);
+        if(!p) { // keep the slot free
+            __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        ev->data = p;
+        ev->size = len;
+    }
+    if(len)
+        memcpy(ev->data, data, len);
+    ev->len = len;
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
 
-    ltox->callbacks.friend_action = 1;
-    tox_callback_friend_action(ltox->tox, on_friend_action, lobj);
-    return 0;
+/**
+ * receipt tracker: keeps the send time and an optional tag of each receipt in an open addressing
+ * table keyed by friend and receipt, so that read receipts come with their delivery latency
+ * latencies are counted in log2 millisecond buckets, globally and per friend
+ */
+static uint32_t receipt_hash(uint64_t key) {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
 }
 
-void on_name_change(Tox *tox, int32_t friendnumber, const uint8_t *string, uint16_t length, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.name_change) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushlstring(Ls, (const char*)string, length);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "name_change",0,3);
+static LToxReceipts *receipts_new(uint32_t capacity) {
+    uint32_t n = 16;
+    while(n < capacity)
+        n <<= 1;
+    LToxReceipts *r = (LToxReceipts*)calloc(1, sizeof(LToxReceipts));
+    if(!r)
+        return NULL;
+    r->slots = (LToxReceipt*)calloc(n, sizeof(LToxReceipt));
+    if(!r->slots) {
+        free(r);
+        return NULL;
     }
+    r->capacity = n;
+    return r;
 }
-int lua_tox_callback_name_change(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "name_change", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+static void receipts_free(LToxReceipts *r) {
+    if(!r)
+        return;
+    free(r->slots);
+    free(r->friends);
+    free(r);
+}
 
-    ltox->callbacks.name_change = 1;
-    tox_callback_name_change(ltox->tox, on_name_change, lobj);
-    return 0;
+// key 0 marks a free slot, receipts are never 0
+static LToxReceipt *receipts_slot(LToxReceipt *slots, uint32_t capacity, uint64_t key) {
+    uint32_t mask = capacity - 1;
+    uint32_t i = receipt_hash(key) & mask;
+    while(slots[i].key && slots[i].key != key)
+        i = (i+1) & mask;
+    return &slots[i];
 }
 
-void on_status_message(Tox *tox, int32_t friendnumber, const uint8_t *string, uint16_t length, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.status_message) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushlstring(Ls, (const char*)string, length);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "status_message", 0, 3);
+static int receipts_grow(LToxReceipts *r) {
+    uint32_t capacity = r->capacity * 2;
+    LToxReceipt *slots = (LToxReceipt*)calloc(capacity, sizeof(LToxReceipt));
+    if(!slots)
+        return 0;
+    for(uint32_t i=0;i<r->capacity;++i) {
+        if(r->slots[i].key)
+            *receipts_slot(slots, capacity, r->slots[i].key) = r->slots[i];
     }
+    free(r->slots);
+    r->slots = slots;
+    r->capacity = capacity;
+    return 1;
 }
-int lua_tox_callback_status_message(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "status_message", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+static void receipts_put(LToxReceipts *r, int32_t friendnumber, uint32_t receipt, const lua_Number *tag) {
+    if((r->count + 1) * 10 > r->capacity * 7 && !receipts_grow(r))
+        return;
+    uint64_t key = ((uint64_t)(uint32_t)friendnumber << 32) | receipt;
+    LToxReceipt *slot = receipts_slot(r->slots, r->capacity, key);
+    if(!slot->key)
+        ++r->count;
+    slot->key = key;
+    slot->sent = ltox_now();
+    slot->tagged = (tag != NULL);
+    slot->tag = tag ? *tag : 0;
+}
 
-    ltox->callbacks.status_message = 1;
-    tox_callback_status_message(ltox->tox, on_status_message, lobj);
-    return 0;
+// removes slot i, shifting back the entries of its probe sequence
+static void receipts_delete(LToxReceipts *r, uint32_t i) {
+    uint32_t mask = r->capacity - 1;
+    uint32_t j = i;
+    for(;;) {
+        j = (j+1) & mask;
+        if(!r->slots[j].key)
+            break;
+        uint32_t k = receipt_hash(r->slots[j].key) & mask;
+        if((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            r->slots[i] = r->slots[j];
+            i = j;
+        }
+    }
+    r->slots[i].key = 0;
+    --r->count;
 }
 
-void on_user_status(Tox *tox, int32_t friendnumber, uint8_t status, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.user_status) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushnumber(Ls, status);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "user_status", 0, 3);
+// forgets the receipts in flight to friendnumber
+static void receipts_purge(LToxReceipts *r, int32_t friendnumber) {
+    uint32_t i = 0;
+    while(i < r->capacity) {
+        if(r->slots[i].key && (int32_t)(r->slots[i].key >> 32) == friendnumber)
+            receipts_delete(r, i); // an entry may have been shifted into i, look at it again
+        else
+            ++i;
     }
 }
-int lua_tox_callback_user_status(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "user_status", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+// latency stats of a friend, NULL if they can't be allocated
+static LToxLatency *receipts_friend(LToxReceipts *r, int32_t friendnumber) {
+    if(friendnumber < 0)
+        return NULL;
+    if((uint32_t)friendnumber >= r->nb_friends) {
+        uint32_t n = friendnumber + 1;
+        LToxLatency *friends = (LToxLatency*)realloc(r->friends, n * sizeof(LToxLatency));
+        if(!friends)
+            return NULL;
+        memset(friends + r->nb_friends, 0, (n - r->nb_friends) * sizeof(LToxLatency));
+        r->friends = friends;
+        r->nb_friends = n;
+    }
+    return &r->friends[friendnumber];
+}
 
-    ltox->callbacks.user_status = 1;
-    tox_callback_user_status(ltox->tox, on_user_status, lobj);
-    return 0;
+static void latency_add(LToxLatency *l, uint32_t ms) {
+    int b = 0;
+    while(b < RECEIPT_BUCKETS-1 && (1U << b) <= ms)
+        ++b;
+    ++l->buckets[b];
+    ++l->count;
+    l->sum += ms;
+    if(ms > l->max)
+        l->max = ms;
 }
 
-void on_typing_change(Tox *tox, int32_t friendnumber, uint8_t is_typing, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.typing_change) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushboolean(Ls, (is_typing==1));
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "typing_change", 0, 3);
-    }
+// takes the receipt out of the tracker and records its latency
+// returns 0 if the receipt wasn't tracked
+static int receipts_done(LToxReceipts *r, int32_t friendnumber, uint32_t receipt, uint32_t *ms, lua_Number *tag, int *tagged) {
+    uint64_t key = ((uint64_t)(uint32_t)friendnumber << 32) | receipt;
+    LToxReceipt *slot = receipts_slot(r->slots, r->capacity, key);
+    if(!slot->key)
+        return 0;
+    *ms = (uint32_t)((ltox_now() - slot->sent) / 1000000ULL);
+    *tag = slot->tag;
+    *tagged = slot->tagged;
+    receipts_delete(r, slot - r->slots);
+
+    latency_add(&r->global, *ms);
+    LToxLatency *l = receipts_friend(r, friendnumber);
+    if(l)
+        latency_add(l, *ms);
+    return 1;
 }
-int lua_tox_callback_typing_change(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "typing_change", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+/**
+ * friend index: open addressing table from client id to friend number, so that
+ * getFriendNumber doesn't scan the friend list; kept up to date on add and delete
+ * and rebuilt from tox on the first lookup after a load
+ */
+static uint32_t index_hash(const uint8_t *id) {
+    uint32_t h;
+    memcpy(&h, id, sizeof(h)); // client ids are public keys, already uniform
+    return h * 0x9E3779B1U;
+}
 
-    ltox->callbacks.typing_change = 1;
-    tox_callback_typing_change(ltox->tox, on_typing_change, lobj);
-    return 0;
+static LToxFriendKey *index_slot(LToxFriendKey *slots, uint32_t capacity, const uint8_t *id) {
+    uint32_t mask = capacity - 1;
+    uint32_t i = index_hash(id) & mask;
+    while(slots[i].friendnumber >= 0 && memcmp(slots[i].id, id, TOX_CLIENT_ID_SIZE))
+        i = (i+1) & mask;
+    return &slots[i];
 }
 
-void on_read_receipt(Tox *tox, int32_t friendnumber, uint32_t receipt, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.read_receipt) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushnumber(Ls, receipt);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "read_receipt", 0, 3);
+static int index_resize(LToxFriendIndex *idx, uint32_t capacity) {
+    LToxFriendKey *slots = (LToxFriendKey*)malloc(capacity * sizeof(LToxFriendKey));
+    if(!slots)
+        return 0;
+    for(uint32_t i=0;i<capacity;++i)
+        slots[i].friendnumber = -1;
+    for(uint32_t i=0;i<idx->capacity;++i) {
+        if(idx->slots[i].friendnumber >= 0)
+            *index_slot(slots, capacity, idx->slots[i].id) = idx->slots[i];
     }
+    free(idx->slots);
+    idx->slots = slots;
+    idx->capacity = capacity;
+    return 1;
 }
-int lua_tox_callback_read_receipt(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "read_receipt", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+static void index_free(LToxFriendIndex *idx) {
+    free(idx->slots);
+    idx->slots = NULL;
+    idx->capacity = idx->count = 0;
+    idx->stale = 1;
+}
 
-    ltox->callbacks.read_receipt = 1;
-    tox_callback_read_receipt(ltox->tox, on_read_receipt, lobj);
-    return 0;
+static void index_put(LToxFriendIndex *idx, const uint8_t *id, int32_t friendnumber) {
+    if(idx->stale || friendnumber < 0)
+        return;
+    if((idx->count + 1) * 10 > idx->capacity * 7
+            && !index_resize(idx, idx->capacity ? idx->capacity * 2 : 16)) {
+        idx->stale = 1;
+        return;
+    }
+    LToxFriendKey *slot = index_slot(idx->slots, idx->capacity, id);
+    if(slot->friendnumber < 0)
+        ++idx->count;
+    memcpy(slot->id, id, TOX_CLIENT_ID_SIZE);
+    slot->friendnumber = friendnumber;
 }
 
-void on_connection_status(Tox *tox, int32_t friendnumber, uint8_t status, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.connection_status) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushnumber(Ls, status);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "connection_status", 0, 3);
+// backward shift deletion, as in receipts_delete
+static void index_remove(LToxFriendIndex *idx, const uint8_t *id) {
+    if(idx->stale || !idx->count)
+        return;
+    uint32_t mask = idx->capacity - 1;
+    uint32_t i = index_slot(idx->slots, idx->capacity, id) - idx->slots;
+    if(idx->slots[i].friendnumber < 0)
+        return;
+    uint32_t j = i;
+    for(;;) {
+        j = (j+1) & mask;
+        if(idx->slots[j].friendnumber < 0)
+            break;
+        uint32_t k = index_hash(idx->slots[j].id) & mask;
+        if((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            idx->slots[i] = idx->slots[j];
+            i = j;
+        }
     }
+    idx->slots[i].friendnumber = -1;
+    --idx->count;
 }
-int lua_tox_callback_connection_status(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "connection_status", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+static int index_rebuild(Tox *tox, LToxFriendIndex *idx) {
+    uint32_t count = tox_count_friendlist(tox);
+    uint32_t capacity = 16;
+    while(capacity * 7 < count * 10)
+        capacity <<= 1;
+    int32_t *list = (int32_t*)malloc((count ? count : 1) * sizeof(int32_t));
+    if(!list)
+        return 0;
+    idx->capacity = idx->count = 0;
+    free(idx->slots);
+    idx->slots = NULL;
+    if(!index_resize(idx, capacity)) {
+        free(list);
+        return 0;
+    }
+    idx->stale = 0;
+    count = tox_get_friendlist(tox, list, count);
+    uint8_t id[TOX_CLIENT_ID_SIZE];
+    for(uint32_t i=0;i<count;++i) {
+        if(tox_get_client_id(tox, list[i], id) == 0)
+            index_put(idx, id, list[i]);
+    }
+    free(list);
+    return !idx->stale;
+}
 
-    ltox->callbacks.connection_status = 1;
-    tox_callback_connection_status(ltox->tox, on_connection_status, lobj);
-    return 0;
+// friend number of a client id, -1 if it isn't a friend
+static int32_t index_lookup(Tox *tox, LToxFriendIndex *idx, const uint8_t *id) {
+    if(idx->stale && !index_rebuild(tox, idx))
+        return tox_get_friend_number(tox, id);
+    LToxFriendKey *slot = index_slot(idx->slots, idx->capacity, id);
+    if(slot->friendnumber < 0)
+        return -1;
+    uint8_t check[TOX_CLIENT_ID_SIZE];
+    if(tox_get_client_id(tox, slot->friendnumber, check) == 0
+            && !memcmp(check, id, TOX_CLIENT_ID_SIZE))
+        return slot->friendnumber;
+    idx->stale = 1; // out of sync, someone changed the list behind our back
+    return tox_get_friend_number(tox, id);
 }
 
-void on_group_invite(Tox *tox, int32_t friendnumber, const uint8_t *group_pub_key, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.group_invite) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushlstring(Ls, (const char*)group_pub_key, TOX_CLIENT_ID_SIZE);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "group_invite", 0, 3);
+/**
+ * presence log: the last connection and user status of each friend, and the list of friends
+ * whose presence changed since the last poll, fed by the hooks whether Lua handles them or not
+ * a friend is listed once however many times it changes, so the list never outgrows the table
+ */
+static void presence_changed(LTox *ltox, int32_t friendnumber, int what, int value) {
+    if(friendnumber < 0)
+        return;
+    if((uint32_t)friendnumber >= ltox->nb_presence) {
+        uint32_t n = ltox->nb_presence ? ltox->nb_presence : 16;
+        while(n <= (uint32_t)friendnumber)
+            n <<= 1;
+        LToxPresence *presence = (LToxPresence*)realloc(ltox->presence, n * sizeof(LToxPresence));
+        if(!presence)
+            return;
+        ltox->presence = presence;
+        int32_t *changed = (int32_t*)realloc(ltox->changed, n * sizeof(int32_t));
+        if(!changed)
+            return;
+        ltox->changed = changed;
+        memset(presence + ltox->nb_presence, 0, (n - ltox->nb_presence) * sizeof(LToxPresence));
+        ltox->nb_presence = n;
     }
+    LToxPresence *p = &ltox->presence[friendnumber];
+    if(what == PRESENCE_ONLINE) {
+        if(p->online == !!value)
+            return;
+        p->online = !!value;
+    }
+    else if(what == PRESENCE_USER_STATUS) {
+        if(p->status == value)
+            return;
+        p->status = value;
+    }
+    if(!p->changed)
+        ltox->changed[ltox->nb_changed++] = friendnumber;
+    p->changed |= what;
 }
-int lua_tox_callback_group_invite(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "group_invite", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+// forgets a deleted friend, the number will be reused
+static void presence_clear(LTox *ltox, int32_t friendnumber) {
+    if(friendnumber < 0 || (uint32_t)friendnumber >= ltox->nb_presence)
+        return;
+    LToxPresence *p = &ltox->presence[friendnumber];
+    if(p->changed) {
+        for(uint32_t i=0;i<ltox->nb_changed;++i) {
+            if(ltox->changed[i] == friendnumber) {
+                memmove(&ltox->changed[i], &ltox->changed[i+1], (--ltox->nb_changed - i) * sizeof(int32_t));
+                break;
+            }
+        }
+    }
+    memset(p, 0, sizeof(LToxPresence));
+}
 
-    ltox->callbacks.group_invite = 1;
-    tox_callback_group_invite(ltox->tox, on_group_invite, lobj);
-    return 0;
+static int ltox_register(lua_State *L, int cb);
+static void autosave_tick(LTox *ltox, int force);
+enum journal_record {
+    JOURNAL_ADD_FRIEND = 1,     // address, request message
+    JOURNAL_ADD_FRIEND_NOREQUEST, // client id
+    JOURNAL_DEL_FRIEND,         // client id
+    JOURNAL_NAME,
+    JOURNAL_STATUS_MESSAGE,
+    JOURNAL_USER_STATUS,        // 1 byte
+    JOURNAL_NOSPAM              // 4 bytes, little endian
+};
+static void journal_append(LTox *ltox, int type, const uint8_t *data, size_t len, const uint8_t *more, size_t more_len);
+static void journal_tick(LTox *ltox);
+static int journal_replay(LTox *ltox, const char *path);
+static void outbox_flush(LTox *ltox, int32_t friendnumber);
+static void outbox_clear(LTox *ltox, int32_t friendnumber);
+
+// reports the error message on top of the stack for the handler of cb:
+// queued when isolation is enabled, raised otherwise
+static void ltox_callback_error(lua_State *L, LTox *ltox, int cb) {
+    if(!ltox->max_errors) {
+        const char *msg = lua_tostring(L,-1);
+        lua_pushfstring(L, "Failed to execute callback '%s': %s", callback_names[cb], msg);
+        lua_error(L);
+    }
+    if(ltox->nb_errors < ltox->max_errors) {
+        const char *msg = lua_tostring(L,-1);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->errors);
+        lua_pushfstring(L, "Failed to execute callback '%s': %s", callback_names[cb], msg);
+        lua_rawseti(L, -2, ++ltox->nb_errors);
+        lua_pop(L,1); // errors
+    }
+    else
+        ++ltox->errors_dropped;
+    lua_pop(L,1); // message
 }
 
-void on_group_message(Tox *tox, int groupnumber, int peernumber, const uint8_t *message, uint16_t length, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.group_message) {
-        lua_pushnumber(Ls, groupnumber);
-        lua_pushnumber(Ls, peernumber);
-        lua_pushlstring(Ls, (const char*)message, length);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "group_message", 0, 4);
+// sets the wake condition of a task from the values yielded by its coroutine:
+// a number of milliseconds, a predicate polled on each tick, or nothing for the next tick
+static void task_wait(lua_State *L, LToxTask *task) {
+    lua_State *co = task->co;
+    luaL_unref(L, LUA_REGISTRYINDEX, task->until);
+    task->until = LUA_NOREF;
+    task->wake = 0;
+    if(lua_gettop(co) >= 1) {
+        if(lua_type(co, 1) == LUA_TNUMBER)
+            task->wake = ltox_now() + (uint64_t)(lua_tonumber(co, 1) * 1000000.0);
+        else if(lua_isfunction(co, 1)) {
+            lua_pushvalue(co, 1);
+            lua_xmove(co, L, 1);
+            task->until = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
     }
+    lua_settop(co, 0);
 }
-int lua_tox_callback_group_message(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "group_message", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+// parks the coroutine on top of the stack
+static void task_park(lua_State *L, LTox *ltox, lua_State *co, int cb) {
+    if(ltox->nb_tasks == ltox->max_tasks) {
+        uint32_t max = ltox->max_tasks ? ltox->max_tasks * 2 : 8;
+        LToxTask *tasks = (LToxTask*)realloc(ltox->tasks, max * sizeof(LToxTask));
+        if(tasks == NULL) {
+            lua_pop(L,1);
+            lua_pushliteral(L, "out of memory");
+            ltox_callback_error(L, ltox, cb);
+            return;
+        }
+        ltox->tasks = tasks;
+        ltox->max_tasks = max;
+    }
+    LToxTask *task = &ltox->tasks[ltox->nb_tasks++];
+    task->co = co;
+    task->thread = luaL_ref(L, LUA_REGISTRYINDEX);
+    task->until = LUA_NOREF;
+    task->cb = cb;
+    task_wait(L, task);
+}
 
-    ltox->callbacks.group_message = 1;
-    tox_callback_group_message(ltox->tox, on_group_message, lobj);
-    return 0;
+static void task_remove(lua_State *L, LTox *ltox, uint32_t i) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ltox->tasks[i].thread);
+    luaL_unref(L, LUA_REGISTRYINDEX, ltox->tasks[i].until);
+    ltox->tasks[i] = ltox->tasks[--ltox->nb_tasks];
 }
 
-void on_group_action(Tox *tox, int groupnumber, int peernumber,
-        const uint8_t *action, uint16_t length, void *obj)
-{
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.group_action) {
-        lua_pushnumber(Ls, groupnumber);
-        lua_pushnumber(Ls, peernumber);
-        lua_pushlstring(Ls, (const char*)action, length);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "group_action", 0, 4);
+// runs the handler of cb in a new coroutine, parking it if it yields
+static void ltox_spawn(lua_State *L, LTox *ltox, int cb, int nb_args) {
+    lua_State *co = lua_newthread(L);
+    lua_insert(L, -(nb_args+1));
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->callbacks[cb]);
+    lua_insert(L, -(nb_args+1));
+    lua_xmove(L, co, nb_args+1);
+
+    int status = resume_thread(L, co, nb_args);
+    if(status == LUA_YIELD)
+        task_park(L, ltox, co, cb);
+    else if(status) {
+        lua_xmove(co, L, 1);
+        lua_remove(L, -2); // thread
+        ltox_callback_error(L, ltox, cb);
     }
+    else
+        lua_pop(L,1); // thread
 }
-int lua_tox_callback_group_action(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "group_action", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+// resumes the parked handlers whose wake condition fired
+static void ltox_resume(lua_State *L, LTox *ltox) {
+    if(ltox->resuming || !ltox->nb_tasks)
+        return;
+    ltox->resuming = 1;
+    uint64_t now = ltox_now();
+    uint32_t i = 0;
+    while(i < ltox->nb_tasks) {
+        LToxTask *task = &ltox->tasks[i];
+        int cb = task->cb;
+        if(task->until != LUA_NOREF) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, task->until);
+            if(lua_pcall(L, 0, 1, 0)) {
+                task_remove(L, ltox, i);
+                ltox->resuming = 0;
+                ltox_callback_error(L, ltox, cb);
+                ltox->resuming = 1;
+                continue;
+            }
+            int ready = lua_toboolean(L,-1);
+            lua_pop(L,1);
+            if(!ready) {
+                ++i;
+                continue;
+            }
+        }
+        else if(task->wake > now) {
+            ++i;
+            continue;
+        }
 
-    ltox->callbacks.group_action = 1;
-    tox_callback_group_action(ltox->tox, on_group_action, lobj);
-    return 0;
+        lua_State *co = task->co;
+        int status = resume_thread(L, co, 0);
+        if(status == LUA_YIELD) {
+            task_wait(L, &ltox->tasks[i]);
+            ++i;
+        }
+        else if(status) {
+            lua_xmove(co, L, 1);
+            task_remove(L, ltox, i);
+            ltox->resuming = 0;
+            ltox_callback_error(L, ltox, cb);
+            ltox->resuming = 1;
+        }
+        else
+            task_remove(L, ltox, i);
+    }
+    ltox->resuming = 0;
 }
 
-void on_group_namelist_change(Tox *tox, int groupnumber, int peernumber, uint8_t change, void *obj) {
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.group_namelist_change) {
-        lua_pushnumber(Ls, groupnumber);
-        lua_pushnumber(Ls, peernumber);
-        lua_pushnumber(Ls, change);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "group_namelist_change", 0, 4);
+// earliest deadline at which ltox needs servicing, given the next tox_do deadline
+static uint64_t ltox_next_wake(LTox *ltox, uint64_t deadline) {
+    for(uint32_t i=0;i<ltox->nb_tasks;++i) {
+        // predicates and next-tick tasks wait for the regular tox_do
+        if(ltox->tasks[i].until == LUA_NOREF && ltox->tasks[i].wake && ltox->tasks[i].wake < deadline)
+            deadline = ltox->tasks[i].wake;
     }
+    if(ltox->coalesced != LUA_NOREF && !ltox->coalesce_ticks) {
+        for(uint32_t i=0;i<ltox->nb_pending;++i) {
+            if(ltox->pending[i].deadline < deadline)
+                deadline = ltox->pending[i].deadline;
+        }
+    }
+    if(ltox->queued) {
+        for(uint32_t i=0;i<ltox->nb_outboxes;++i) {
+            LToxOutbox *q = &ltox->outboxes[i];
+            if(q->head && q->retry_at && q->retry_at < deadline)
+                deadline = q->retry_at;
+        }
+    }
+    if(ltox->dirty && ltox->autosave && ltox->autosave->last + ltox->autosave->interval < deadline)
+        deadline = ltox->autosave->last + ltox->autosave->interval;
+    return deadline;
 }
-int lua_tox_callback_group_namelist_change(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "group_namelist_change", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
-
-    ltox->callbacks.group_namelist_change = 1;
-    tox_callback_group_namelist_change(ltox->tox, on_group_namelist_change, lobj);
-    return 0;
+// calls the handler of cb with the nb_args values on top of the stack
+// errors are queued instead of raised when isolation is enabled
+static void ltox_call(lua_State *L, LTox *ltox, int cb, int nb_args) {
+    if(ltox->coroutines) {
+        ltox_spawn(L, ltox, cb, nb_args);
+        return;
+    }
+    if(!ltox->max_errors) {
+        call_ref(L, ltox->callbacks[cb], callback_names[cb], 0, nb_args);
+        return;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->callbacks[cb]);
+    lua_insert(L, -(nb_args+1));
+    if(lua_pcall(L, nb_args, 0, 0))
+        ltox_callback_error(L, ltox, cb);
 }
 
-void on_file_send_request(Tox *tox, int32_t friendnumber, uint8_t filenumber, uint64_t filesize,
-        const uint8_t *filename, uint16_t filename_length, void *obj)
-{
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    if(ltox->callbacks.file_send_request) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushnumber(Ls, filenumber);
-        lua_pushnumber(Ls, filesize);
-        lua_pushlstring(Ls, (const char*)filename, filename_length);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "file_send_request", 0, 5);
+/**
+ * message coalescing: when enabled, the messages of a friend received within a window of ticks
+ * or milliseconds are collected in an array and the handler is called once with it
+ */
+static void coalesce_push(lua_State *L, LTox *ltox, int32_t friendnumber, const uint8_t *message, uint16_t length) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->coalesced);
+    lua_rawgeti(L, -1, friendnumber);
+    if(lua_isnil(L,-1)) { // first message of a burst
+        lua_pop(L,1);
+        if(ltox->nb_pending == ltox->max_pending) {
+            uint32_t max = ltox->max_pending ? ltox->max_pending * 2 : 8;
+            LToxPending *pending = (LToxPending*)realloc(ltox->pending, max * sizeof(LToxPending));
+            if(!pending) {
+                lua_pop(L,1);
+                luaL_error(L, "Can't allocate coalesced messages.");
+            }
+            ltox->pending = pending;
+            ltox->max_pending = max;
+        }
+        LToxPending *p = &ltox->pending[ltox->nb_pending++];
+        p->friendnumber = friendnumber;
+        p->tick = ltox->ticks;
+        p->deadline = ltox_now() + (uint64_t)ltox->coalesce_ms * 1000000ULL;
+        lua_createtable(L, 4, 0);
+        lua_pushvalue(L,-1);
+        lua_rawseti(L, -3, friendnumber);
     }
+    int n = lua_objlen(L,-1);
+    lua_pushlstring(L, (const char*)message, length);
+    lua_rawseti(L, -2, n+1);
+    lua_pop(L,2);
 }
-int lua_tox_callback_file_send_request(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "file_send_request", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+// calls the handler with the bursts whose window is over, or with all of them
+static void coalesce_flush(lua_State *L, LTox *ltox, int all) {
+    uint64_t now = ltox_now();
+    uint32_t i = 0;
+    while(i < ltox->nb_pending) {
+        LToxPending *p = &ltox->pending[i];
+        int over = ltox->coalesce_ticks ? (ltox->ticks - p->tick >= ltox->coalesce_ticks) : (now >= p->deadline);
+        if(!all && !over) {
+            ++i;
+            continue;
+        }
+        int32_t friendnumber = p->friendnumber;
+        ltox->pending[i] = ltox->pending[--ltox->nb_pending];
 
-    ltox->callbacks.file_send_request = 1;
-    tox_callback_file_send_request(ltox->tox, on_file_send_request, lobj);
-    return 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->coalesced);
+        lua_rawgeti(L, -1, friendnumber);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, friendnumber);
+        lua_remove(L, -2);
+        if(ltox->callbacks[CB_FRIEND_MESSAGE] == LUA_NOREF) {
+            lua_pop(L,1);
+            continue;
+        }
+        lua_pushnumber(L, friendnumber);
+        lua_insert(L, -2);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_FRIEND_MESSAGE]);
+        ltox_call(L, ltox, CB_FRIEND_MESSAGE, 3);
+    }
 }
 
-void on_file_control (Tox *tox, int32_t friendnumber, uint8_t send_receive, 
-        uint8_t filenumber, uint8_t control_type, const uint8_t *data, uint16_t length, void *obj)
-{
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    void *userdata = lobj->userdata;
-    if(ltox->callbacks.file_control) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushnumber(Ls, send_receive); // reveiving == 1, sending == 0
-        lua_pushnumber(Ls, filenumber);
-        lua_pushnumber(Ls, control_type);
-        lua_pushlstring(Ls, (const char*)data, length);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "file_control", 0, 6);
+void on_friend_request(Tox *tox, const uint8_t *public_key, const uint8_t *data, uint16_t length, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_FRIEND_REQUEST);
+        if(ev) {
+            memcpy(ev->key, public_key, TOX_CLIENT_ID_SIZE);
+            events_commit(ltox->events, ev, data, length);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_FRIEND_REQUEST] != LUA_NOREF) {
+        lua_pushlstring(L, (const char*)public_key, TOX_CLIENT_ID_SIZE);
+        lua_pushlstring(L, (const char*)data, length);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_FRIEND_REQUEST]);
+        ltox_call(L, ltox, CB_FRIEND_REQUEST, 3);
     }
 }
-int lua_tox_callback_file_control(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "file_control", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
-
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+int lua_tox_callback_friend_request(lua_State* L) {
+    return ltox_register(L, CB_FRIEND_REQUEST);
+}
 
-    ltox->callbacks.file_control = 1;
-    tox_callback_file_control(ltox->tox, on_file_control, lobj);
-    return 0;
+void on_friend_message(Tox *tox, int32_t friendnumber, const uint8_t *message, uint16_t length, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_FRIEND_MESSAGE);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            events_commit(ltox->events, ev, message, length);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_FRIEND_MESSAGE] != LUA_NOREF) {
+        if(ltox->coalesced != LUA_NOREF) {
+            coalesce_push(L, ltox, friendnumber, message, length);
+            return;
+        }
+        lua_pushnumber(L, friendnumber);
+        lua_pushlstring(L, (const char*)message, length);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_FRIEND_MESSAGE]);
+        ltox_call(L, ltox, CB_FRIEND_MESSAGE, 3);
+    }
+}
+int lua_tox_callback_friend_message(lua_State* L) {
+    return ltox_register(L, CB_FRIEND_MESSAGE);
 }
 
-void on_file_data(Tox *tox, int32_t friendnumber, uint8_t filenumber, const uint8_t *data, 
-        uint16_t length, void *obj)
-{
-    LObj *lobj = (LObj*)obj;
-    LTox *ltox = lobj->ltox;
-    size_t len = 0;
-    void *userdata = lobj->userdata;
-    if(ltox->callbacks.file_data) {
-        lua_pushnumber(Ls, friendnumber);
-        lua_pushnumber(Ls, filenumber);
-        lua_pushlstring(Ls, (const char*)data, length);
-        lua_pushlstring(Ls, (const char*)lobj->userdata, lobj->len);
-        call_cb(Ls, ltox, "file_data", 0, 4);
+void on_friend_action(Tox *tox, int32_t friendnumber, const uint8_t *action, uint16_t length, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_FRIEND_ACTION);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            events_commit(ltox->events, ev, action, length);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_FRIEND_ACTION] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushlstring(L, (const char*)action, length);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_FRIEND_ACTION]);
+        ltox_call(L, ltox, CB_FRIEND_ACTION, 3);
     }
 }
-int lua_tox_callback_file_data(lua_State* L) {
-    LTox *ltox = checkLTox(L,1);
-    set(L, ltox, "file_data", 2);
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-    lua_settop(L,0);
+int lua_tox_callback_friend_action(lua_State* L) {
+    return ltox_register(L, CB_FRIEND_ACTION);
+}
 
-    LObj *lobj = createUserdata(L, ltox, userdata, len);
+void on_name_change(Tox *tox, int32_t friendnumber, const uint8_t *string, uint16_t length, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    presence_changed(ltox, friendnumber, PRESENCE_NAME, 0);
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_NAME_CHANGE);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            events_commit(ltox->events, ev, string, length);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_NAME_CHANGE] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushlstring(L, (const char*)string, length);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_NAME_CHANGE]);
+        ltox_call(L, ltox, CB_NAME_CHANGE, 3);
+    }
+}
+int lua_tox_callback_name_change(lua_State* L) {
+    return ltox_register(L, CB_NAME_CHANGE);
+}
 
-    ltox->callbacks.file_data = 1;
-    tox_callback_file_data(ltox->tox, on_file_data, lobj);
-    return 0;
+void on_status_message(Tox *tox, int32_t friendnumber, const uint8_t *string, uint16_t length, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    presence_changed(ltox, friendnumber, PRESENCE_STATUS_MESSAGE, 0);
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_STATUS_MESSAGE);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            events_commit(ltox->events, ev, string, length);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_STATUS_MESSAGE] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushlstring(L, (const char*)string, length);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_STATUS_MESSAGE]);
+        ltox_call(L, ltox, CB_STATUS_MESSAGE, 3);
+    }
+}
+int lua_tox_callback_status_message(lua_State* L) {
+    return ltox_register(L, CB_STATUS_MESSAGE);
 }
 
-/***********************
- *                     *
- * Tox wrapped methods *
- *                     *
+void on_user_status(Tox *tox, int32_t friendnumber, uint8_t status, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    presence_changed(ltox, friendnumber, PRESENCE_USER_STATUS, status);
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_USER_STATUS);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            ev->args[1] = status;
+            events_commit(ltox->events, ev, NULL, 0);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_USER_STATUS] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushnumber(L, status);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_USER_STATUS]);
+        ltox_call(L, ltox, CB_USER_STATUS, 3);
+    }
+}
+int lua_tox_callback_user_status(lua_State* L) {
+    return ltox_register(L, CB_USER_STATUS);
+}
+
+void on_typing_change(Tox *tox, int32_t friendnumber, uint8_t is_typing, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_TYPING_CHANGE);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            ev->args[1] = is_typing;
+            events_commit(ltox->events, ev, NULL, 0);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_TYPING_CHANGE] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushboolean(L, (is_typing==1));
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_TYPING_CHANGE]);
+        ltox_call(L, ltox, CB_TYPING_CHANGE, 3);
+    }
+}
+int lua_tox_callback_typing_change(lua_State* L) {
+    return ltox_register(L, CB_TYPING_CHANGE);
+}
+
+void on_read_receipt(Tox *tox, int32_t friendnumber, uint32_t receipt, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    uint32_t ms = 0;
+    lua_Number tag = 0;
+    int tagged = 0;
+    int tracked = ltox->receipts && receipts_done(ltox->receipts, friendnumber, receipt, &ms, &tag, &tagged);
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_READ_RECEIPT);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            ev->args[1] = tracked ? (int32_t)ms : -1;
+            ev->args[2] = tagged;
+            memcpy(ev->key, &tag, sizeof(tag)); // key is unused by receipts
+            ev->value = receipt;
+            events_commit(ltox->events, ev, NULL, 0);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_READ_RECEIPT] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushnumber(L, receipt);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_READ_RECEIPT]);
+        // latency and tag come after userdata, not to break existing handlers
+        if(tracked)
+            lua_pushnumber(L, ms);
+        else
+            lua_pushnil(L);
+        if(tagged)
+            lua_pushnumber(L, tag);
+        else
+            lua_pushnil(L);
+        ltox_call(L, ltox, CB_READ_RECEIPT, 5);
+    }
+}
+int lua_tox_callback_read_receipt(lua_State* L) {
+    return ltox_register(L, CB_READ_RECEIPT);
+}
+
+void on_connection_status(Tox *tox, int32_t friendnumber, uint8_t status, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    presence_changed(ltox, friendnumber, PRESENCE_ONLINE, status);
+    if(status == 1)
+        outbox_flush(ltox, friendnumber);
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_CONNECTION_STATUS);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            ev->args[1] = status;
+            events_commit(ltox->events, ev, NULL, 0);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_CONNECTION_STATUS] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushnumber(L, status);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_CONNECTION_STATUS]);
+        ltox_call(L, ltox, CB_CONNECTION_STATUS, 3);
+    }
+}
+int lua_tox_callback_connection_status(lua_State* L) {
+    return ltox_register(L, CB_CONNECTION_STATUS);
+}
+
+void on_group_invite(Tox *tox, int32_t friendnumber, const uint8_t *group_pub_key, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_GROUP_INVITE);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            memcpy(ev->key, group_pub_key, TOX_CLIENT_ID_SIZE);
+            events_commit(ltox->events, ev, NULL, 0);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_GROUP_INVITE] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushlstring(L, (const char*)group_pub_key, TOX_CLIENT_ID_SIZE);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_GROUP_INVITE]);
+        ltox_call(L, ltox, CB_GROUP_INVITE, 3);
+    }
+}
+int lua_tox_callback_group_invite(lua_State* L) {
+    return ltox_register(L, CB_GROUP_INVITE);
+}
+
+void on_group_message(Tox *tox, int groupnumber, int peernumber, const uint8_t *message, uint16_t length, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_GROUP_MESSAGE);
+        if(ev) {
+            ev->args[0] = groupnumber;
+            ev->args[1] = peernumber;
+            events_commit(ltox->events, ev, message, length);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_GROUP_MESSAGE] != LUA_NOREF) {
+        lua_pushnumber(L, groupnumber);
+        lua_pushnumber(L, peernumber);
+        lua_pushlstring(L, (const char*)message, length);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_GROUP_MESSAGE]);
+        ltox_call(L, ltox, CB_GROUP_MESSAGE, 4);
+    }
+}
+int lua_tox_callback_group_message(lua_State* L) {
+    return ltox_register(L, CB_GROUP_MESSAGE);
+}
+
+void on_group_action(Tox *tox, int groupnumber, int peernumber,
+        const uint8_t *action, uint16_t length, void *obj)
+{
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_GROUP_ACTION);
+        if(ev) {
+            ev->args[0] = groupnumber;
+            ev->args[1] = peernumber;
+            events_commit(ltox->events, ev, action, length);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_GROUP_ACTION] != LUA_NOREF) {
+        lua_pushnumber(L, groupnumber);
+        lua_pushnumber(L, peernumber);
+        lua_pushlstring(L, (const char*)action, length);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_GROUP_ACTION]);
+        ltox_call(L, ltox, CB_GROUP_ACTION, 4);
+    }
+}
+int lua_tox_callback_group_action(lua_State* L) {
+    return ltox_register(L, CB_GROUP_ACTION);
+}
+
+void on_group_namelist_change(Tox *tox, int groupnumber, int peernumber, uint8_t change, void *obj) {
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_GROUP_NAMELIST_CHANGE);
+        if(ev) {
+            ev->args[0] = groupnumber;
+            ev->args[1] = peernumber;
+            ev->args[2] = change;
+            events_commit(ltox->events, ev, NULL, 0);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_GROUP_NAMELIST_CHANGE] != LUA_NOREF) {
+        lua_pushnumber(L, groupnumber);
+        lua_pushnumber(L, peernumber);
+        lua_pushnumber(L, change);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_GROUP_NAMELIST_CHANGE]);
+        ltox_call(L, ltox, CB_GROUP_NAMELIST_CHANGE, 4);
+    }
+}
+int lua_tox_callback_group_namelist_change(lua_State* L) {
+    return ltox_register(L, CB_GROUP_NAMELIST_CHANGE);
+}
+
+void on_file_send_request(Tox *tox, int32_t friendnumber, uint8_t filenumber, uint64_t filesize,
+        const uint8_t *filename, uint16_t filename_length, void *obj)
+{
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_FILE_SEND_REQUEST);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            ev->args[1] = filenumber;
+            ev->value = filesize;
+            events_commit(ltox->events, ev, filename, filename_length);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_FILE_SEND_REQUEST] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushnumber(L, filenumber);
+        lua_pushnumber(L, filesize);
+        lua_pushlstring(L, (const char*)filename, filename_length);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_FILE_SEND_REQUEST]);
+        ltox_call(L, ltox, CB_FILE_SEND_REQUEST, 5);
+    }
+}
+int lua_tox_callback_file_send_request(lua_State* L) {
+    return ltox_register(L, CB_FILE_SEND_REQUEST);
+}
+
+void on_file_control (Tox *tox, int32_t friendnumber, uint8_t send_receive, 
+        uint8_t filenumber, uint8_t control_type, const uint8_t *data, uint16_t length, void *obj)
+{
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_FILE_CONTROL);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            ev->args[1] = send_receive;
+            ev->args[2] = filenumber;
+            ev->args[3] = control_type;
+            events_commit(ltox->events, ev, data, length);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_FILE_CONTROL] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushnumber(L, send_receive); // reveiving == 1, sending == 0
+        lua_pushnumber(L, filenumber);
+        lua_pushnumber(L, control_type);
+        lua_pushlstring(L, (const char*)data, length);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_FILE_CONTROL]);
+        ltox_call(L, ltox, CB_FILE_CONTROL, 6);
+    }
+}
+int lua_tox_callback_file_control(lua_State* L) {
+    return ltox_register(L, CB_FILE_CONTROL);
+}
+
+void on_file_data(Tox *tox, int32_t friendnumber, uint8_t filenumber, const uint8_t *data, 
+        uint16_t length, void *obj)
+{
+    LTox *ltox = (LTox*)obj;
+    lua_State *L = ltox->L;
+    if(ltox->events) {
+        LToxEvent *ev = events_reserve(ltox->events, CB_FILE_DATA);
+        if(ev) {
+            ev->args[0] = friendnumber;
+            ev->args[1] = filenumber;
+            events_commit(ltox->events, ev, data, length);
+        }
+        return;
+    }
+    if(ltox->callbacks[CB_FILE_DATA] != LUA_NOREF) {
+        lua_pushnumber(L, friendnumber);
+        lua_pushnumber(L, filenumber);
+        if(ltox->receive && buffer_set(ltox->receive, data, length))
+            lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->receive_ref);
+        else
+            lua_pushlstring(L, (const char*)data, length);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->userdata[CB_FILE_DATA]);
+        ltox_call(L, ltox, CB_FILE_DATA, 4);
+    }
+}
+int lua_tox_callback_file_data(lua_State* L) {
+    return ltox_register(L, CB_FILE_DATA);
+}
+
+// hooks the C callback into toxcore
+static void ltox_hook(LTox *ltox, int cb) {
+    ltox->hooked[cb] = 1;
+    switch(cb) {
+        case CB_FRIEND_REQUEST:
+            tox_callback_friend_request(ltox->tox, on_friend_request, ltox);
+            break;
+        case CB_FRIEND_MESSAGE:
+            tox_callback_friend_message(ltox->tox, on_friend_message, ltox);
+            break;
+        case CB_FRIEND_ACTION:
+            tox_callback_friend_action(ltox->tox, on_friend_action, ltox);
+            break;
+        case CB_NAME_CHANGE:
+            tox_callback_name_change(ltox->tox, on_name_change, ltox);
+            break;
+        case CB_STATUS_MESSAGE:
+            tox_callback_status_message(ltox->tox, on_status_message, ltox);
+            break;
+        case CB_USER_STATUS:
+            tox_callback_user_status(ltox->tox, on_user_status, ltox);
+            break;
+        case CB_TYPING_CHANGE:
+            tox_callback_typing_change(ltox->tox, on_typing_change, ltox);
+            break;
+        case CB_READ_RECEIPT:
+            tox_callback_read_receipt(ltox->tox, on_read_receipt, ltox);
+            break;
+        case CB_CONNECTION_STATUS:
+            tox_callback_connection_status(ltox->tox, on_connection_status, ltox);
+            break;
+        case CB_GROUP_INVITE:
+            tox_callback_group_invite(ltox->tox, on_group_invite, ltox);
+            break;
+        case CB_GROUP_MESSAGE:
+            tox_callback_group_message(ltox->tox, on_group_message, ltox);
+            break;
+        case CB_GROUP_ACTION:
+            tox_callback_group_action(ltox->tox, on_group_action, ltox);
+            break;
+        case CB_GROUP_NAMELIST_CHANGE:
+            tox_callback_group_namelist_change(ltox->tox, on_group_namelist_change, ltox);
+            break;
+        case CB_FILE_SEND_REQUEST:
+            tox_callback_file_send_request(ltox->tox, on_file_send_request, ltox);
+            break;
+        case CB_FILE_CONTROL:
+            tox_callback_file_control(ltox->tox, on_file_control, ltox);
+            break;
+        case CB_FILE_DATA:
+            tox_callback_file_data(ltox->tox, on_file_data, ltox);
+            break;
+    }
+}
+
+// stores the handler at index in the dispatch array, nil removes it
+static void ltox_set_callback(lua_State *L, LTox *ltox, int cb, int index) {
+    if( ! lua_isnoneornil(L, index) && ! lua_isfunction(L, index) ) {
+        lua_pushfstring(L, "luatox ERROR: callback: %s is not a valid function: %s.", 
+                                callback_names[cb], lua_typename(L, lua_type(L, index)));
+        lua_error(L);
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, ltox->callbacks[cb]);
+    ltox->callbacks[cb] = LUA_NOREF;
+    if( ! lua_isnoneornil(L, index) ) {
+        lua_pushvalue(L, index);
+        ltox->callbacks[cb] = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
+// (self, fn, userdata) from the Lua stack
+static int ltox_register(lua_State *L, int cb) {
+    LTox *ltox = checkLTox(L,1);
+    ltox_set_callback(L, ltox, cb, 2);
+
+    // any Lua value, handed back as is
+    luaL_unref(L, LUA_REGISTRYINDEX, ltox->userdata[cb]);
+    ltox->userdata[cb] = LUA_NOREF;
+    if( ! lua_isnoneornil(L,3) ) {
+        lua_pushvalue(L,3);
+        ltox->userdata[cb] = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_settop(L,0);
+
+    if(!ltox->hooked[cb])
+        ltox_hook(ltox, cb);
+    return 0;
+}
+
+// generic registration: tox:on(eventName, fn, userdata)
+int lua_tox_on(lua_State* L) {
+    checkLTox(L,1);
+    int cb = luaL_checkoption(L, 2, NULL, callback_names);
+    lua_remove(L,2);
+    return ltox_register(L, cb);
+}
+
+// same arguments as the handler would get, without userdata
+static int push_event_args(lua_State *L, LToxEvent *ev) {
+    switch(ev->type) {
+        case CB_FRIEND_REQUEST:
+            lua_pushlstring(L, (const char*)ev->key, TOX_CLIENT_ID_SIZE);
+            lua_pushlstring(L, (const char*)ev->data, ev->len);
+            return 2;
+        case CB_FRIEND_MESSAGE:
+        case CB_FRIEND_ACTION:
+        case CB_NAME_CHANGE:
+        case CB_STATUS_MESSAGE:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushlstring(L, (const char*)ev->data, ev->len);
+            return 2;
+        case CB_USER_STATUS:
+        case CB_CONNECTION_STATUS:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushnumber(L, ev->args[1]);
+            return 2;
+        case CB_TYPING_CHANGE:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushboolean(L, (ev->args[1]==1));
+            return 2;
+        case CB_READ_RECEIPT:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushnumber(L, ev->value);
+            if(ev->args[1] >= 0)
+                lua_pushnumber(L, ev->args[1]);
+            else
+                lua_pushnil(L);
+            if(ev->args[2]) {
+                lua_Number tag;
+                memcpy(&tag, ev->key, sizeof(tag));
+                lua_pushnumber(L, tag);
+            }
+            else
+                lua_pushnil(L);
+            return 4;
+        case CB_GROUP_INVITE:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushlstring(L, (const char*)ev->key, TOX_CLIENT_ID_SIZE);
+            return 2;
+        case CB_GROUP_MESSAGE:
+        case CB_GROUP_ACTION:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushnumber(L, ev->args[1]);
+            lua_pushlstring(L, (const char*)ev->data, ev->len);
+            return 3;
+        case CB_GROUP_NAMELIST_CHANGE:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushnumber(L, ev->args[1]);
+            lua_pushnumber(L, ev->args[2]);
+            return 3;
+        case CB_FILE_SEND_REQUEST:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushnumber(L, ev->args[1]);
+            lua_pushnumber(L, ev->value);
+            lua_pushlstring(L, (const char*)ev->data, ev->len);
+            return 4;
+        case CB_FILE_CONTROL:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushnumber(L, ev->args[1]);
+            lua_pushnumber(L, ev->args[2]);
+            lua_pushnumber(L, ev->args[3]);
+            lua_pushlstring(L, (const char*)ev->data, ev->len);
+            return 5;
+        case CB_FILE_DATA:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushnumber(L, ev->args[1]);
+            lua_pushlstring(L, (const char*)ev->data, ev->len);
+            return 3;
+        case EV_COMMAND:
+            lua_pushnumber(L, ev->args[0]);
+            lua_pushstring(L, command_names[ev->args[1]]);
+            lua_pushnumber(L, (int64_t)ev->value);
+            return 3;
+    }
+    return 0;
+}
+
+// tox:batchEvents(capacity) enables batched delivery, tox:batchEvents(false) disables it
+// the capacity is rounded up to a power of 2
+int lua_tox_batch_events(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    int enable = lua_isnoneornil(L,2) || lua_type(L,2) == LUA_TNUMBER || lua_toboolean(L,2);
+    uint32_t capacity = (lua_type(L,2) == LUA_TNUMBER) ? (uint32_t)lua_tonumber(L,2) : 1024;
+    lua_settop(L,0);
+
+    events_free(ltox->events);
+    ltox->events = NULL;
+    if(!enable || capacity == 0) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // every kind has to reach the C side, handler or not
+    for(int cb=0;cb<CB_MAX;++cb) {
+        if(!ltox->hooked[cb])
+            ltox_hook(ltox, cb);
+    }
+    ltox->events = events_new(capacity);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// returns an array of { eventName, args... } and the number of events dropped since the last call
+int lua_tox_drain_events(lua_State* L) {
+    LTox *ltox = checkLTox(L,1);
+    uint32_t max = lua_isnoneornil(L,2) ? 0 : (uint32_t)luaL_checknumber(L,2);
+    lua_settop(L,0);
+
+    LToxEvents *q = ltox->events;
+    if(!q) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Batched events are not enabled.");
+        return 2;
+    }
+    uint32_t n = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - q->head;
+    if(max && n > max)
+        n = max;
+
+    lua_createtable(L, n, 0);
+    for(uint32_t i=0;i<n;++i) {
+        LToxEvent *ev = &q->slots[(q->head + i) & (q->capacity - 1)];
+        lua_createtable(L, 6, 0);
+        lua_pushstring(L, ev->type == EV_COMMAND ? "command" : callback_names[ev->type]);
+        lua_rawseti(L, -2, 1);
+        int nb = push_event_args(L, ev);
+        for(int j=nb;j>0;--j)
+            lua_rawseti(L, -(j+1), j+1);
+        lua_rawseti(L, -2, i+1);
+    }
+    __atomic_store_n(&q->head, q->head + n, __ATOMIC_RELEASE);
+
+    lua_pushnumber(L, __atomic_exchange_n(&q->dropped, 0, __ATOMIC_RELAXED));
+    return 2;
+}
+
+// tox:isolateErrors(max) queues up to max callback errors instead of raising them,
+// tox:isolateErrors(false) restores raising
+int lua_tox_isolate_errors(lua_State* L) {
+    LTox *ltox = checkLTox(L,1);
+    int enable = lua_isnoneornil(L,2) || lua_type(L,2) == LUA_TNUMBER || lua_toboolean(L,2);
+    uint32_t max = (lua_type(L,2) == LUA_TNUMBER) ? (uint32_t)lua_tonumber(L,2) : 64;
+    lua_settop(L,0);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, ltox->errors);
+    ltox->errors = LUA_NOREF;
+    ltox->nb_errors = 0;
+    ltox->errors_dropped = 0;
+    ltox->max_errors = enable ? max : 0;
+    if(ltox->max_errors) {
+        lua_createtable(L, ltox->max_errors, 0);
+        ltox->errors = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// tox:receiveInto(buffer) hands file data to the handler in buffer, overwritten by each chunk,
+// instead of a new string; chunks that don't fit are still passed as strings
+// tox:receiveInto(nil) restores strings
+int lua_tox_receive_into(lua_State* L) {
+    LTox *ltox = checkLTox(L,1);
+    LToxBuffer *b = lua_isnoneornil(L,2) ? NULL : check_buffer(L,2);
+    luaL_unref(L, LUA_REGISTRYINDEX, ltox->receive_ref);
+    ltox->receive_ref = LUA_NOREF;
+    ltox->receive = b;
+    if(b) {
+        lua_pushvalue(L,2);
+        ltox->receive_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_settop(L,0);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// tox:coalesceMessages{ ticks = n } or { ms = n } collects the messages a friend sends
+// within the window and calls the friend message handler once with an array of them
+// tox:coalesceMessages(false) delivers what's pending and restores one call per message
+int lua_tox_coalesce_messages(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    uint32_t ticks = 0, ms = 0;
+    int enable = lua_istable(L,2);
+    if(enable) {
+        lua_getfield(L, 2, "ticks");
+        if(!lua_isnil(L,-1))
+            ticks = (uint32_t)luaL_checknumber(L,-1);
+        lua_getfield(L, 2, "ms");
+        if(!lua_isnil(L,-1))
+            ms = (uint32_t)luaL_checknumber(L,-1);
+        if(!ticks && !ms)
+            ticks = 1;
+    }
+    else if(!lua_isnoneornil(L,2) && lua_toboolean(L,2))
+        return luaL_typerror(L, 2, "table or false");
+    lua_settop(L,0);
+
+    if(ltox->coalesced != LUA_NOREF) {
+        coalesce_flush(L, ltox, 1);
+        luaL_unref(L, LUA_REGISTRYINDEX, ltox->coalesced);
+        ltox->coalesced = LUA_NOREF;
+    }
+    if(enable) {
+        lua_newtable(L);
+        ltox->coalesced = luaL_ref(L, LUA_REGISTRYINDEX);
+        ltox->coalesce_ticks = ticks;
+        ltox->coalesce_ms = ms;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// tox:useCoroutines(true) runs each handler in its own coroutine; a handler that yields
+// is parked and resumed after tox_do once its wake condition fires:
+// coroutine.yield(ms), coroutine.yield(predicate) or coroutine.yield() for the next tick
+int lua_tox_use_coroutines(lua_State* L) {
+    LTox *ltox = checkLTox(L,1);
+    ltox->coroutines = lua_isnoneornil(L,2) || lua_toboolean(L,2);
+    lua_settop(L,0);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// returns the queued error messages and how many were dropped, then clears the queue
+int lua_tox_errors(lua_State* L) {
+    LTox *ltox = checkLTox(L,1);
+    lua_settop(L,0);
+    if(!ltox->max_errors) {
+        lua_newtable(L);
+        lua_pushnumber(L, 0);
+        return 2;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ltox->errors);
+    luaL_unref(L, LUA_REGISTRYINDEX, ltox->errors);
+    lua_createtable(L, ltox->max_errors, 0);
+    ltox->errors = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushnumber(L, ltox->errors_dropped);
+    ltox->nb_errors = 0;
+    ltox->errors_dropped = 0;
+    return 2;
+}
+
+/***********************
+ *                     *
+ * Tox wrapped methods *
+ *                     *
  ***********************/
 
 int lua_tox_get_address(lua_State* L) {
@@ -744,14 +1803,18 @@ int lua_tox_get_address(lua_State* L) {
 
 int lua_tox_add_friend(lua_State* L) {
     Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
     uint8_t *address = (uint8_t*)luaL_checkstring(L, 2);
     size_t len;
-    uint8_t *msg = (uint8_t*)lua_tolstring(L,3, &len);
+    uint8_t *msg = (uint8_t*)opt_data(L, 3, &len);
     lua_settop(L,0);
 
     int32_t status = tox_add_friend(tox, address, msg, len);
     if(status<0)
         return throw_error(L, status);
+    index_put(&ltox->index, address, status); // address starts with the client id
+    ltox->dirty = 1;
+    journal_append(ltox, JOURNAL_ADD_FRIEND, address, TOX_FRIEND_ADDRESS_SIZE, msg, len);
     
     lua_pushnumber(L, status);
     return 1;
@@ -759,9 +1822,10 @@ int lua_tox_add_friend(lua_State* L) {
 
 int lua_tox_add_friend_string(lua_State* L) {
     Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
     uint8_t *address = (uint8_t*)luaL_checkstring(L, 2);
     size_t len;
-    uint8_t *msg = (uint8_t*)lua_tolstring(L,3, &len);
+    uint8_t *msg = (uint8_t*)opt_data(L, 3, &len);
     lua_settop(L,0);
 
     uint8_t data[TOX_FRIEND_ADDRESS_SIZE] = {0};
@@ -769,9 +1833,12 @@ int lua_tox_add_friend_string(lua_State* L) {
         return throw_error(L, TOX_FAERR_BADCHECKSUM);
     // try dns3_lookup if failed ?
 
-    int32_t status = tox_add_friend(tox, data, msg, strlen((char*)data));
+    int32_t status = tox_add_friend(tox, data, msg, len);
     if(status<0)
         return throw_error(L, status);
+    index_put(&ltox->index, data, status);
+    ltox->dirty = 1;
+    journal_append(ltox, JOURNAL_ADD_FRIEND, data, TOX_FRIEND_ADDRESS_SIZE, msg, len);
     
     lua_pushnumber(L, status);
     return 1;
@@ -779,23 +1846,62 @@ int lua_tox_add_friend_string(lua_State* L) {
 
 int lua_tox_add_friend_norequest(lua_State* L) {
     Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
     uint8_t *client_id = (uint8_t*)luaL_checkstring(L,2);
     lua_settop(L,0);
     int32_t status = tox_add_friend_norequest(tox, client_id);
-    lua_pushnumber(L,status);
     if(status<0)
         return throw_error(L, status);
+    index_put(&ltox->index, client_id, status);
+    ltox->dirty = 1;
+    journal_append(ltox, JOURNAL_ADD_FRIEND_NOREQUEST, client_id, TOX_CLIENT_ID_SIZE, NULL, 0);
 
     lua_pushnumber(L, status);
     return 1;
 }   
 
+// tox:addFriendsNorequest(ids) adds the concatenated 32 bytes client ids of a string or buffer
+// returns an array of friend numbers, or of the negative TOX_FAERR codes for the ids that failed,
+// and the number of friends added
+int lua_tox_add_friends_norequest(lua_State* L) {
+    Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
+    size_t len;
+    const uint8_t *ids = (const uint8_t*)check_data(L, 2, &len);
+    if(len % TOX_CLIENT_ID_SIZE) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Client ids must be %d bytes each.", TOX_CLIENT_ID_SIZE);
+        return 2;
+    }
+    uint32_t count = len / TOX_CLIENT_ID_SIZE;
+    uint32_t added = 0;
+    lua_createtable(L, count, 0); // keeps the data below it on the stack
+    for(uint32_t i=0;i<count;++i) {
+        const uint8_t *id = ids + i * TOX_CLIENT_ID_SIZE;
+        int32_t status = tox_add_friend_norequest(tox, id);
+        if(status >= 0) {
+            index_put(&ltox->index, id, status);
+            ltox->dirty = 1;
+            journal_append(ltox, JOURNAL_ADD_FRIEND_NOREQUEST, id, TOX_CLIENT_ID_SIZE, NULL, 0);
+            ++added;
+        }
+        lua_pushnumber(L, status);
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_pushnumber(L, added);
+    return 2;
+}
+
 int lua_tox_get_friend_number(lua_State* L) {
     Tox *tox = checkTox(L,1);
-    uint8_t *client_id = (uint8_t*)luaL_checkstring(L,2);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
+    size_t len;
+    uint8_t *client_id = (uint8_t*)luaL_checklstring(L,2,&len);
+    if(len < TOX_CLIENT_ID_SIZE)
+        return luaL_argerror(L, 2, "client id too short");
     lua_settop(L,0);
 
-    int32_t num = tox_get_friend_number(tox, client_id);
+    int32_t num = index_lookup(tox, &ltox->index, client_id);
     if(num<0)
         return throw_error(L, num);
     
@@ -819,9 +1925,26 @@ int lua_tox_get_client_id(lua_State* L) {
 
 int lua_tox_del_friend(lua_State* L) {
     Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
     int32_t friendnumber = luaL_checknumber(L,2);
     lua_settop(L,0);
+    uint8_t client_id[TOX_CLIENT_ID_SIZE];
+    int known = (tox_get_client_id(tox, friendnumber, client_id) == 0);
     int r = tox_del_friend(tox, friendnumber);
+    if(r==0) {
+        if(known) {
+            index_remove(&ltox->index, client_id);
+            journal_append(ltox, JOURNAL_DEL_FRIEND, client_id, TOX_CLIENT_ID_SIZE, NULL, 0);
+        }
+        presence_clear(ltox, friendnumber);
+        ltox->dirty = 1;
+        outbox_clear(ltox, friendnumber);
+        if(ltox->receipts) { // number will be reused
+            receipts_purge(ltox->receipts, friendnumber);
+            if((uint32_t)friendnumber < ltox->receipts->nb_friends)
+                memset(&ltox->receipts->friends[friendnumber], 0, sizeof(LToxLatency));
+        }
+    }
     lua_pushboolean(L, (r==0));
     return 1;
 }
@@ -847,41 +1970,93 @@ int lua_tox_friend_exists(lua_State* L) {
     return 1;
 }
 
-int lua_send_messages(lua_State *L, Tox *tox, int32_t friendnumber, uint8_t *message, size_t len) {
-    lua_newtable(L);
+typedef uint32_t (*send_fn)(Tox*, int32_t, const uint8_t*, uint32_t);
+
+static int is_space(uint8_t c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+// length of the next chunk of message, at most max bytes
+// cuts after the last whitespace of the second half of the chunk if any,
+// and never inside a UTF-8 sequence
+static size_t next_chunk(const uint8_t *message, size_t len, size_t max) {
+    if(len <= max)
+        return len;
+    size_t cut = max;
+    while(cut > 0 && (message[cut] & 0xC0) == 0x80) // continuation byte
+        --cut;
+    if(cut == 0) // not UTF-8, cut anyway
+        cut = max;
+    for(size_t i=cut;i>cut/2;--i) {
+        if(is_space(message[i-1]))
+            return i;
+    }
+    return cut;
+}
+
+// sends one message, tracking its receipt if enabled
+static uint32_t ltox_send(LTox *ltox, send_fn send, int32_t friendnumber, const uint8_t *message, uint32_t len, const lua_Number *tag) {
+    uint32_t receipt = send(ltox->tox, friendnumber, message, len);
+    if(receipt && ltox->receipts)
+        receipts_put(ltox->receipts, friendnumber, receipt, tag);
+    return receipt;
+}
+
+// sends message in chunks of TOX_MAX_MESSAGE_LENGTH bytes at most
+// returns the receipt of the last chunk, 0 as soon as one fails
+static uint32_t ltox_send_chunks(LTox *ltox, send_fn send, int32_t friendnumber, const uint8_t *message, size_t len) {
+    uint32_t receipt = 0;
+    size_t cur = 0;
+    while(cur < len) {
+        size_t n = next_chunk(message + cur, len - cur, TOX_MAX_MESSAGE_LENGTH);
+        receipt = ltox_send(ltox, send, friendnumber, message + cur, n, NULL);
+        if(receipt == 0)
+            return 0;
+        cur += n;
+    }
+    return receipt;
+}
+
+// sends message in chunks of TOX_MAX_MESSAGE_LENGTH bytes at most, straight from the Lua string
+// returns the array of receipts, or nil, an error and the receipts of the chunks already sent
+static int lua_send_messages(lua_State *L, LTox *ltox, send_fn send, int32_t friendnumber, const uint8_t *message, size_t len, const lua_Number *tag) {
+    lua_createtable(L, len / TOX_MAX_MESSAGE_LENGTH + 1, 0);
     int top = lua_gettop(L);
-    int i = 1, cur = 0;
-    int res = 0;
-    while (cur < len) {
-        size_t max = (len - cur) > TOX_MAX_NAME_LENGTH ? TOX_MAX_NAME_LENGTH : (len-cur);
-        uint8_t msg[max];
-        memcpy(msg, message+cur, max);
-        cur = len - max + 1;
-        res = tox_send_message(tox, friendnumber, message, len);
-        if(res==0)
-            break;
-        lua_pushnumber(L, ++i);
+    int i = 0;
+    size_t cur = 0;
+    while(cur < len) {
+        size_t n = next_chunk(message + cur, len - cur, TOX_MAX_MESSAGE_LENGTH);
+        uint32_t res = ltox_send(ltox, send, friendnumber, message + cur, n, tag);
+        if(res==0) { // nil, message, receipts in place of the receipts
+            lua_settop(L, top);
+            lua_pushnil(L);
+            lua_insert(L, top);
+            lua_pushliteral(L, "Failed to send message.");
+            lua_insert(L, top+1);
+            return 3;
+        }
         lua_pushnumber(L, res);
-        lua_settable(L, top);
-    }
-    if(res==0) {
-        lua_pop(L,1);
-        lua_pushnil(L);
-        lua_pushliteral(L, "Failed to send message.");
-        return 2;
+        lua_rawseti(L, top, ++i);
+        cur += n;
     }
     return 1;
 }
+
+// tox:sendMessage(friendnumber, message [, tag]), the tag is handed back with the read receipt
+// when receipts are tracked
+// messages longer than TOX_MAX_MESSAGE_LENGTH are split and an array of receipts is returned
 int lua_tox_send_message(lua_State* L) {
-    Tox *tox = checkTox(L,1);
+    LTox *ltox = checkOwnedLTox(L,1);
+    lua_Number tag = lua_isnoneornil(L,4) ? 0 : luaL_checknumber(L,4);
+    const lua_Number *tagp = lua_isnoneornil(L,4) ? NULL : &tag;
     int32_t friendnumber = luaL_checknumber(L,2);
     size_t len;
-    uint8_t *message = (uint8_t*)luaL_checklstring(L,3,&len);
+    uint8_t *message = (uint8_t*)check_data(L, 3, &len);
+    if( len > TOX_MAX_MESSAGE_LENGTH ) // keep the message on the stack while sending
+        return lua_send_messages(L, ltox, tox_send_message, friendnumber, message, len, tagp);
     lua_settop(L,0);
-    if( len > TOX_MAX_MESSAGE_LENGTH )
-        return lua_send_messages(L, tox, friendnumber, message, len);
 
-    int r = tox_send_message(tox, friendnumber, message, len);
+    int r = ltox_send(ltox, tox_send_message, friendnumber, message, len, tagp);
     if(r==0) {
         lua_pushnil(L);
         lua_pushliteral(L, "Failed to send message.");
@@ -891,18 +2066,19 @@ int lua_tox_send_message(lua_State* L) {
     return 1;
 }
 
+// same as sendMessage
 int lua_tox_send_action(lua_State* L) {
-    Tox *tox = checkTox(L,1);
+    LTox *ltox = checkOwnedLTox(L,1);
+    lua_Number tag = lua_isnoneornil(L,4) ? 0 : luaL_checknumber(L,4);
+    const lua_Number *tagp = lua_isnoneornil(L,4) ? NULL : &tag;
     int32_t friendnumber = luaL_checknumber(L,2);
     size_t len;
-    uint8_t *action = (uint8_t*)luaL_checklstring(L,3, &len);
+    uint8_t *action = (uint8_t*)check_data(L, 3, &len);
+    if( len > TOX_MAX_MESSAGE_LENGTH )
+        return lua_send_messages(L, ltox, tox_send_action, friendnumber, action, len, tagp);
     lua_settop(L,0);
-    if( len > TOX_MAX_MESSAGE_LENGTH ) {
-        lua_pushnil(L);
-        lua_pushfstring(L, "Message too long (%lu > %d).", len, TOX_MAX_MESSAGE_LENGTH);
-        return 2;
-    }
-    int r = tox_send_action(tox, friendnumber, action, len);
+
+    int r = ltox_send(ltox, tox_send_action, friendnumber, action, len, tagp);
     if(r==0) {
         lua_pushnil(L);
         lua_pushliteral(L, "Unknown error.");
@@ -912,13 +2088,398 @@ int lua_tox_send_action(lua_State* L) {
     return 1;
 }
 
-int lua_tox_set_name(lua_State* L) {
-    Tox *tox = checkTox(L,1);
-    size_t len;
-    uint8_t *name = (uint8_t*)lua_tolstring(L,2, &len);
-    lua_settop(L,0);
+// sends message to friendnumber, pushing the receipt (an array for long messages) or false
+static void broadcast_one(lua_State *L, LTox *ltox, send_fn send, int32_t friendnumber, const uint8_t *message, size_t len) {
+    if(len > TOX_MAX_MESSAGE_LENGTH) {
+        int top = lua_gettop(L);
+        if(lua_send_messages(L, ltox, send, friendnumber, message, len, NULL) > 1) {
+            lua_settop(L, top);
+            lua_pushboolean(L, 0);
+        }
+        return;
+    }
+    uint32_t r = ltox_send(ltox, send, friendnumber, message, len, NULL);
+    if(r)
+        lua_pushnumber(L, r);
+    else
+        lua_pushboolean(L, 0);
+}
 
-    int r = tox_set_name(tox, name, len);
+// tox:broadcastMessage(targets, message [, action]) sends message to an array of friend numbers
+// or to every online friend when targets is "online"
+// returns a table of friendnumber -> receipt or false, and the number of friends reached
+int lua_tox_broadcast_message(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    Tox *tox = ltox->tox;
+    size_t len;
+    const uint8_t *message = (const uint8_t*)check_data(L, 3, &len);
+    send_fn send = lua_toboolean(L,4) ? tox_send_action : tox_send_message;
+    int online = 0;
+    if(lua_type(L,2) == LUA_TSTRING) {
+        if(strcmp(lua_tostring(L,2), "online"))
+            return luaL_argerror(L, 2, "array of friend numbers or \"online\" expected");
+        online = 1;
+    }
+    else
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+    int count = 0;
+    if(online) {
+        uint32_t size = tox_count_friendlist(tox);
+        int32_t *list = NULL;
+        if(size && !(list = (int32_t*)malloc(size * sizeof(int32_t)))) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "Can't allocate friend list.");
+            return 2;
+        }
+        size = tox_get_friendlist(tox, list, size);
+        lua_createtable(L, 0, size);
+        for(uint32_t i=0;i<size;++i) {
+            if(tox_get_friend_connection_status(tox, list[i]) != 1)
+                continue;
+            broadcast_one(L, ltox, send, list[i], message, len);
+            count += lua_toboolean(L,-1);
+            lua_rawseti(L, -2, list[i]);
+        }
+        free(list);
+    }
+    else {
+        int n = lua_objlen(L,2);
+        for(int i=1;i<=n;++i) { // checked up front, so a bad target doesn't leave a partial broadcast
+            lua_rawgeti(L, 2, i);
+            if(!lua_isnumber(L,-1))
+                return luaL_argerror(L, 2, "friend numbers expected");
+            lua_pop(L,1);
+        }
+        lua_createtable(L, 0, n);
+        for(int i=1;i<=n;++i) {
+            lua_rawgeti(L, 2, i);
+            int32_t friendnumber = (int32_t)lua_tonumber(L,-1);
+            lua_pop(L,1);
+            broadcast_one(L, ltox, send, friendnumber, message, len);
+            count += lua_toboolean(L,-1);
+            lua_rawseti(L, -2, friendnumber);
+        }
+    }
+    lua_pushnumber(L, count);
+    return 2;
+}
+
+/**
+ * outgoing queues: messages wait in a bounded per friend queue while the friend is offline,
+ * they're flushed when the friend connects and retried with backoff after a failed send
+ */
+#define OUTBOX_BACKOFF_MIN 50   // ms
+#define OUTBOX_BACKOFF_MAX 5000
+
+static void outbox_pop(LTox *ltox, LToxOutbox *q) {
+    LToxOutMsg *m = q->head;
+    q->head = m->next;
+    if(!q->head)
+        q->tail = NULL;
+    --q->count;
+    --ltox->queued;
+    free(m->data);
+    free(m);
+}
+
+static void outbox_clear(LTox *ltox, int32_t friendnumber) {
+    if(friendnumber < 0 || (uint32_t)friendnumber >= ltox->nb_outboxes)
+        return;
+    LToxOutbox *q = &ltox->outboxes[friendnumber];
+    while(q->head)
+        outbox_pop(ltox, q);
+    q->backoff = OUTBOX_BACKOFF_MIN;
+    q->retry_at = 0;
+}
+
+// sends the queued messages of friendnumber until one fails
+static void outbox_flush(LTox *ltox, int32_t friendnumber) {
+    if(friendnumber < 0 || (uint32_t)friendnumber >= ltox->nb_outboxes)
+        return;
+    LToxOutbox *q = &ltox->outboxes[friendnumber];
+    while(q->head) {
+        LToxOutMsg *m = q->head;
+        send_fn send = m->action ? tox_send_action : tox_send_message;
+        while(m->sent < m->len) {
+            size_t n = next_chunk(m->data + m->sent, m->len - m->sent, TOX_MAX_MESSAGE_LENGTH);
+            if(!ltox_send(ltox, send, friendnumber, m->data + m->sent, n, m->tagged ? &m->tag : NULL)) {
+                q->retry_at = ltox_now() + (uint64_t)q->backoff * 1000000ULL;
+                q->backoff = q->backoff * 2 > OUTBOX_BACKOFF_MAX ? OUTBOX_BACKOFF_MAX : q->backoff * 2;
+                return;
+            }
+            m->sent += n;
+        }
+        outbox_pop(ltox, q);
+    }
+    q->backoff = OUTBOX_BACKOFF_MIN;
+    q->retry_at = 0;
+}
+
+// retries the queues of the connected friends once their backoff expired
+static void outbox_retry(LTox *ltox) {
+    if(!ltox->queued)
+        return;
+    uint64_t now = ltox_now();
+    for(uint32_t i=0;i<ltox->nb_outboxes;++i) {
+        LToxOutbox *q = &ltox->outboxes[i];
+        if(q->head && q->retry_at <= now && tox_get_friend_connection_status(ltox->tox, i) == 1)
+            outbox_flush(ltox, i);
+    }
+}
+
+static void outbox_free(LTox *ltox) {
+    for(uint32_t i=0;i<ltox->nb_outboxes;++i)
+        outbox_clear(ltox, i);
+    free(ltox->outboxes);
+    ltox->outboxes = NULL;
+    ltox->nb_outboxes = 0;
+}
+
+static int queue_message(lua_State *L, int action) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    int tagged = !lua_isnoneornil(L,4);
+    lua_Number tag = tagged ? luaL_checknumber(L,4) : 0;
+    int32_t friendnumber = luaL_checknumber(L,2);
+    size_t len;
+    const uint8_t *message = (const uint8_t*)check_data(L, 3, &len);
+    if(len == 0) {
+        lua_settop(L,0);
+        lua_pushnil(L);
+        lua_pushliteral(L, "Empty message.");
+        return 2;
+    }
+    if(!tox_friend_exists(ltox->tox, friendnumber)) {
+        lua_settop(L,0);
+        lua_pushnil(L);
+        lua_pushliteral(L, "Friend doesn't exist.");
+        return 2;
+    }
+    if((uint32_t)friendnumber >= ltox->nb_outboxes) {
+        uint32_t n = friendnumber + 1;
+        LToxOutbox *outboxes = (LToxOutbox*)realloc(ltox->outboxes, n * sizeof(LToxOutbox));
+        if(!outboxes)
+            return luaL_error(L, "Can't allocate outgoing queue.");
+        memset(outboxes + ltox->nb_outboxes, 0, (n - ltox->nb_outboxes) * sizeof(LToxOutbox));
+        for(uint32_t i=ltox->nb_outboxes;i<n;++i)
+            outboxes[i].backoff = OUTBOX_BACKOFF_MIN;
+        ltox->outboxes = outboxes;
+        ltox->nb_outboxes = n;
+    }
+    LToxOutbox *q = &ltox->outboxes[friendnumber];
+    if(q->count >= ltox->max_queued) {
+        lua_settop(L,0);
+        lua_pushnil(L);
+        lua_pushliteral(L, "Queue is full.");
+        lua_pushnumber(L, q->count);
+        return 3;
+    }
+
+    LToxOutMsg *m = (LToxOutMsg*)malloc(sizeof(LToxOutMsg));
+    if(m)
+        m->data = (uint8_t*)malloc(len);
+    if(!m || !m->data) {
+        free(m);
+        return luaL_error(L, "Can't allocate queued message.");
+    }
+    memcpy(m->data, message, len);
+    m->len = len;
+    m->sent = 0;
+    m->action = action;
+    m->tagged = tagged;
+    m->tag = tag;
+    m->next = NULL;
+    if(q->tail)
+        q->tail->next = m;
+    else
+        q->head = m;
+    q->tail = m;
+    ++q->count;
+    ++ltox->queued;
+
+    // connections have to be seen, handler or not
+    if(!ltox->hooked[CB_CONNECTION_STATUS])
+        ltox_hook(ltox, CB_CONNECTION_STATUS);
+    if(q->retry_at <= ltox_now() && tox_get_friend_connection_status(ltox->tox, friendnumber) == 1)
+        outbox_flush(ltox, friendnumber);
+
+    lua_settop(L,0);
+    lua_pushnumber(L, q->count);
+    return 1;
+}
+
+// tox:queueMessage(friendnumber, message [, tag]) sends message now if possible, queues it otherwise
+// returns the number of messages still waiting for the friend,
+// or nil, an error and the queue depth when the queue is full
+// receipts of queued messages aren't returned, since most are sent from later ticks:
+// with trackReceipts, the tag comes back with their read receipts instead
+int lua_tox_queue_message(lua_State* L) {
+    return queue_message(L, 0);
+}
+
+// same as queueMessage, for actions
+int lua_tox_queue_action(lua_State* L) {
+    return queue_message(L, 1);
+}
+
+// tox:trackReceipts(capacity) records the send time of every message receipt so that
+// read receipts report their delivery latency, tox:trackReceipts(false) stops tracking
+int lua_tox_track_receipts(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    int enable = lua_isnoneornil(L,2) || lua_type(L,2) == LUA_TNUMBER || lua_toboolean(L,2);
+    uint32_t capacity = (lua_type(L,2) == LUA_TNUMBER) ? (uint32_t)lua_tonumber(L,2) : 1024;
+    lua_settop(L,0);
+
+    receipts_free(ltox->receipts);
+    ltox->receipts = NULL;
+    if(enable) {
+        ltox->receipts = receipts_new(capacity);
+        if(!ltox->receipts) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "Can't allocate receipt tracker.");
+            return 2;
+        }
+        if(!ltox->hooked[CB_READ_RECEIPT])
+            ltox_hook(ltox, CB_READ_RECEIPT);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static void push_latency(lua_State *L, LToxLatency *l) {
+    lua_createtable(L, 0, 6);
+    lua_pushnumber(L, l->count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, l->lost);
+    lua_setfield(L, -2, "lost");
+    lua_pushnumber(L, l->sum);
+    lua_setfield(L, -2, "sum");
+    lua_pushnumber(L, l->max);
+    lua_setfield(L, -2, "max");
+    lua_pushnumber(L, l->count ? l->sum / l->count : 0);
+    lua_setfield(L, -2, "mean");
+    // histogram[1]: < 1ms, histogram[i]: [2^(i-2), 2^(i-1)[ ms, the last one is open-ended
+    lua_createtable(L, RECEIPT_BUCKETS, 0);
+    for(int b=0;b<RECEIPT_BUCKETS;++b) {
+        lua_pushnumber(L, l->buckets[b]);
+        lua_rawseti(L, -2, b+1);
+    }
+    lua_setfield(L, -2, "histogram");
+}
+
+// tox:receiptStats() returns the global delivery stats, with the number of pending receipts,
+// tox:receiptStats(friendnumber) the stats of a friend
+int lua_tox_receipt_stats(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    int global = lua_isnoneornil(L,2);
+    int32_t friendnumber = global ? -1 : luaL_checknumber(L,2);
+    lua_settop(L,0);
+
+    LToxReceipts *r = ltox->receipts;
+    if(!r) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Receipts are not tracked.");
+        return 2;
+    }
+    if(global) {
+        push_latency(L, &r->global);
+        lua_pushnumber(L, r->count);
+        lua_setfield(L, -2, "pending");
+    }
+    else {
+        LToxLatency empty = {{0}};
+        push_latency(L, (friendnumber >= 0 && (uint32_t)friendnumber < r->nb_friends) ? &r->friends[friendnumber] : &empty);
+    }
+    return 1;
+}
+
+// tox:sweepReceipts(timeout) forgets the receipts older than timeout ms and counts them as lost
+// returns an array of { friendnumber, receipt, tag }
+int lua_tox_sweep_receipts(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    lua_Number ms = luaL_checknumber(L,2);
+    luaL_argcheck(L, ms >= 0, 2, "timeout must be >= 0");
+    uint64_t timeout = (uint64_t)ms * 1000000ULL;
+    lua_settop(L,0);
+
+    LToxReceipts *r = ltox->receipts;
+    if(!r) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Receipts are not tracked.");
+        return 2;
+    }
+    uint64_t now = ltox_now();
+    lua_newtable(L);
+    int n = 0;
+    uint32_t i = 0;
+    while(i < r->capacity) {
+        LToxReceipt *slot = &r->slots[i];
+        if(!slot->key || now - slot->sent < timeout) {
+            ++i;
+            continue;
+        }
+        int32_t friendnumber = (int32_t)(slot->key >> 32);
+        lua_createtable(L, 3, 0);
+        lua_pushnumber(L, friendnumber);
+        lua_rawseti(L, -2, 1);
+        lua_pushnumber(L, (uint32_t)slot->key);
+        lua_rawseti(L, -2, 2);
+        if(slot->tagged) {
+            lua_pushnumber(L, slot->tag);
+            lua_rawseti(L, -2, 3);
+        }
+        lua_rawseti(L, -2, ++n);
+
+        ++r->global.lost;
+        LToxLatency *l = receipts_friend(r, friendnumber);
+        if(l)
+            ++l->lost;
+        receipts_delete(r, i); // an entry may have been shifted into i, look at it again
+    }
+    return 1;
+}
+
+// tox:queueDepth(friendnumber) returns the number of messages waiting for a friend,
+// tox:queueDepth() for all friends
+int lua_tox_queue_depth(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    if(lua_isnoneornil(L,2)) {
+        lua_settop(L,0);
+        lua_pushnumber(L, ltox->queued);
+        return 1;
+    }
+    int32_t friendnumber = luaL_checknumber(L,2);
+    lua_settop(L,0);
+    if(friendnumber < 0 || (uint32_t)friendnumber >= ltox->nb_outboxes)
+        lua_pushnumber(L, 0);
+    else
+        lua_pushnumber(L, ltox->outboxes[friendnumber].count);
+    return 1;
+}
+
+// tox:setQueueLimit(max) bounds each friend's queue, 64 by default, at least 1
+// queues already longer than max keep their messages but take no more
+int lua_tox_set_queue_limit(lua_State* L) {
+    LTox *ltox = checkLTox(L,1);
+    lua_Number max = luaL_checknumber(L,2);
+    luaL_argcheck(L, max >= 1, 2, "limit must be at least 1");
+    lua_settop(L,0);
+    ltox->max_queued = (uint32_t)max;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int lua_tox_set_name(lua_State* L) {
+    Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
+    size_t len;
+    uint8_t *name = (uint8_t*)opt_data(L, 2, &len);
+    lua_settop(L,0);
+
+    int r = tox_set_name(tox, name, len);
+    ltox->dirty |= (r==0);
+    if(r==0)
+        journal_append(ltox, JOURNAL_NAME, name, len, NULL, 0);
     lua_pushboolean(L, (r==0));
     return 1;
 }
@@ -977,20 +2538,28 @@ int lua_tox_get_self_name_size(lua_State* L) {
 
 int lua_tox_set_status_message(lua_State* L) {
     Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
     size_t len;
-    uint8_t *status = (uint8_t*)lua_tolstring(L,2, &len);
+    uint8_t *status = (uint8_t*)opt_data(L, 2, &len);
     lua_settop(L,0);
 
     int r = tox_set_status_message(tox, status, len);
+    ltox->dirty |= (r==0);
+    if(r==0)
+        journal_append(ltox, JOURNAL_STATUS_MESSAGE, status, len, NULL, 0);
     lua_pushboolean(L, (r==0));
     return 1;
 }
 
 int lua_tox_set_user_status(lua_State* L) {
     Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
     uint8_t status = (uint8_t)luaL_checknumber(L,2);
     lua_settop(L,0);
     int r = tox_set_user_status(tox, status);
+    ltox->dirty |= (r==0);
+    if(r==0)
+        journal_append(ltox, JOURNAL_USER_STATUS, &status, 1, NULL, 0);
     lua_pushboolean(L, (r==0));
     return 1;
 }
@@ -1120,19 +2689,251 @@ int lua_tox_get_num_online_friends(lua_State* L) {
     return 1;
 }
 
+// returns an array of friend numbers
 int lua_tox_get_friendlist(lua_State* L) {
     Tox *tox = checkTox(L,1);
     lua_settop(L,0);
     uint32_t size = tox_count_friendlist(tox);
-    int32_t out[size];
+    int32_t *out = NULL;
+    if(size && !(out = (int32_t*)malloc(size * sizeof(int32_t)))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Can't allocate friend list.");
+        return 2;
+    }
     uint32_t n = tox_get_friendlist(tox, out, size);
 
-    lua_newtable(L);
-    for(int i=0;i<n;++i) {
+    lua_createtable(L, n, 0);
+    for(uint32_t i=0;i<n;++i) {
         lua_pushnumber(L,out[i]);
-        lua_pushnumber(L,i+1);
-        lua_settable(L,-3);
+        lua_rawseti(L,-2,i+1);
+    }
+    free(out);
+    return 1;
+}
+
+/**
+ * friend iterator: tox_get_friendlist can't be paged, so friend numbers are scanned
+ * with tox_friend_exists, a page at a time, in the iterator's userdata
+ */
+#define FRIENDS_PAGE 256
+#define FRIENDS_MAX_GAP (1 << 20) // unused numbers in a row before giving up, when the bound is unknown
+
+typedef struct _FriendsIter {
+    int32_t page[FRIENDS_PAGE];
+    uint32_t pos;
+    uint32_t n;
+    int32_t next;           // next friend number to look at
+    uint32_t seen;
+    uint32_t gap;
+    int done;
+} FriendsIter;
+
+static void friends_fill(Tox *tox, FriendsIter *it) {
+    int64_t bound = friend_number_bound(tox);
+    uint32_t count = tox_count_friendlist(tox);
+    it->pos = it->n = 0;
+    while(it->n < FRIENDS_PAGE) {
+        if(bound >= 0 ? it->next >= bound : (it->seen >= count || it->gap >= FRIENDS_MAX_GAP)) {
+            it->done = 1;
+            break;
+        }
+        if(tox_friend_exists(tox, it->next)) {
+            it->page[it->n++] = it->next;
+            ++it->seen;
+            it->gap = 0;
+        }
+        else
+            ++it->gap;
+        ++it->next;
+    }
+}
+
+static int friends_next(lua_State *L) {
+    LTox *ltox = (LTox*)lua_touserdata(L, lua_upvalueindex(1));
+    FriendsIter *it = (FriendsIter*)lua_touserdata(L, lua_upvalueindex(2));
+    if(ltox->tox == NULL)
+        return 0;
+    if(ltox->thread)
+        return luaL_error(L, "Tox instance is owned by its network thread, use post or stopThread.");
+    if(it->pos == it->n) {
+        if(it->done)
+            return 0;
+        friends_fill(ltox->tox, it);
+        if(it->n == 0)
+            return 0;
+    }
+    lua_pushnumber(L, it->page[it->pos++]);
+    return 1;
+}
+
+// for friendnumber in tox:friends() do ... end
+// friends added or deleted while iterating may be missed
+int lua_tox_friends(lua_State* L) {
+    checkTox(L,1);
+    lua_settop(L,1);
+    FriendsIter *it = (FriendsIter*)lua_newuserdata(L, sizeof(FriendsIter));
+    memset(it, 0, sizeof(FriendsIter));
+    lua_pushcclosure(L, friends_next, 2);
+    return 1;
+}
+
+
+enum snapshot_field {
+    SNAP_NAME,
+    SNAP_STATUS_MESSAGE,
+    SNAP_USER_STATUS,
+    SNAP_ONLINE,
+    SNAP_LAST_ONLINE,
+    SNAP_CLIENT_ID,
+    SNAP_MAX
+};
+static const char *snapshot_fields[] = {
+    "name",
+    "statusMessage",
+    "userStatus",
+    "online",
+    "lastOnline",
+    "clientId",
+    NULL
+};
+
+// tox:pollPresenceChanges() returns an array of
+// { friend = number, online = boolean, userStatus = number, changed = { <field> = true, ... } }
+// for the friends whose presence changed since the last call, in the order they first changed,
+// changed fields being online, userStatus, name and statusMessage
+int lua_tox_poll_presence_changes(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    lua_settop(L,0);
+
+    lua_createtable(L, ltox->nb_changed, 0);
+    for(uint32_t i=0;i<ltox->nb_changed;++i) {
+        int32_t friendnumber = ltox->changed[i];
+        LToxPresence *p = &ltox->presence[friendnumber];
+        lua_createtable(L, 0, 4);
+        lua_pushnumber(L, friendnumber);
+        lua_setfield(L, -2, "friend");
+        lua_pushboolean(L, p->online);
+        lua_setfield(L, -2, "online");
+        lua_pushnumber(L, p->status);
+        lua_setfield(L, -2, "userStatus");
+        lua_createtable(L, 0, 4);
+        if(p->changed & PRESENCE_ONLINE) {
+            lua_pushboolean(L, 1);
+            lua_setfield(L, -2, "online");
+        }
+        if(p->changed & PRESENCE_USER_STATUS) {
+            lua_pushboolean(L, 1);
+            lua_setfield(L, -2, "userStatus");
+        }
+        if(p->changed & PRESENCE_NAME) {
+            lua_pushboolean(L, 1);
+            lua_setfield(L, -2, "name");
+        }
+        if(p->changed & PRESENCE_STATUS_MESSAGE) {
+            lua_pushboolean(L, 1);
+            lua_setfield(L, -2, "statusMessage");
+        }
+        lua_setfield(L, -2, "changed");
+        lua_rawseti(L, -2, i+1);
+        p->changed = 0;
+    }
+    ltox->nb_changed = 0;
+    return 1;
+}
+
+// tox:getFriendsSnapshot([fields]) returns an array of { friend = number, <field> = value, ... }
+// for every friend, fields being an array of name, statusMessage, userStatus, online,
+// lastOnline and clientId, all of them by default
+int lua_tox_get_friends_snapshot(lua_State* L) {
+    Tox *tox = checkTox(L,1);
+    int wanted[SNAP_MAX] = {0};
+    int nb_fields = 0;
+    if(lua_isnoneornil(L,2)) {
+        for(int f=0;f<SNAP_MAX;++f)
+            wanted[f] = 1;
+        nb_fields = SNAP_MAX;
+    }
+    else {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        int n = lua_objlen(L,2);
+        for(int i=1;i<=n;++i) {
+            lua_rawgeti(L, 2, i);
+            int f = luaL_checkoption(L, -1, NULL, snapshot_fields);
+            lua_pop(L,1);
+            if(!wanted[f]) {
+                wanted[f] = 1;
+                ++nb_fields;
+            }
+        }
+    }
+    lua_settop(L,0);
+
+    uint32_t size = tox_count_friendlist(tox);
+    int32_t *list = NULL;
+    if(size && !(list = (int32_t*)malloc(size * sizeof(int32_t)))) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Can't allocate friend list.");
+        return 2;
+    }
+    size = tox_get_friendlist(tox, list, size);
+
+    // keys, pushed once: 1 is "friend", 2+f the fields
+    lua_pushliteral(L, "friend");
+    for(int f=0;f<SNAP_MAX;++f)
+        lua_pushstring(L, snapshot_fields[f]);
+
+    uint8_t text[TOX_MAX_STATUSMESSAGE_LENGTH > TOX_MAX_NAME_LENGTH ? TOX_MAX_STATUSMESSAGE_LENGTH : TOX_MAX_NAME_LENGTH];
+    lua_createtable(L, size, 0);
+    for(uint32_t i=0;i<size;++i) {
+        int32_t friendnumber = list[i];
+        lua_createtable(L, 0, nb_fields + 1);
+        lua_pushvalue(L, 1);
+        lua_pushnumber(L, friendnumber);
+        lua_rawset(L, -3);
+        for(int f=0;f<SNAP_MAX;++f) {
+            if(!wanted[f])
+                continue;
+            lua_pushvalue(L, 2+f);
+            switch(f) {
+                case SNAP_NAME: {
+                    int len = tox_get_name(tox, friendnumber, text);
+                    if(len > 0)
+                        lua_pushlstring(L, (char*)text, len);
+                    else
+                        lua_pushnil(L);
+                    break;
+                }
+                case SNAP_STATUS_MESSAGE: {
+                    int len = tox_get_status_message(tox, friendnumber, text, sizeof(text));
+                    if(len > 0)
+                        lua_pushlstring(L, (char*)text, len);
+                    else
+                        lua_pushnil(L);
+                    break;
+                }
+                case SNAP_USER_STATUS:
+                    lua_pushnumber(L, tox_get_user_status(tox, friendnumber));
+                    break;
+                case SNAP_ONLINE:
+                    lua_pushboolean(L, tox_get_friend_connection_status(tox, friendnumber) == 1);
+                    break;
+                case SNAP_LAST_ONLINE:
+                    lua_pushnumber(L, tox_get_last_online(tox, friendnumber));
+                    break;
+                case SNAP_CLIENT_ID: {
+                    uint8_t client_id[TOX_CLIENT_ID_SIZE];
+                    if(tox_get_client_id(tox, friendnumber, client_id) == 0)
+                        lua_pushlstring(L, (char*)client_id, TOX_CLIENT_ID_SIZE);
+                    else
+                        lua_pushnil(L);
+                    break;
+                }
+            }
+            lua_rawset(L, -3);
+        }
+        lua_rawseti(L, -2, i+1);
     }
+    free(list);
     return 1;
 }
 
@@ -1146,9 +2947,13 @@ int lua_tox_get_nospam(lua_State* L) {
 
 int lua_tox_set_nospam(lua_State* L) {
     Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
     uint32_t nospam = luaL_checknumber(L,2);
     lua_settop(L,0);
     tox_set_nospam(tox, nospam);
+    ltox->dirty = 1;
+    uint8_t le[4] = { nospam & 0xff, (nospam >> 8) & 0xff, (nospam >> 16) & 0xff, nospam >> 24 };
+    journal_append(ltox, JOURNAL_NOSPAM, le, sizeof(le), NULL, 0);
     return 0;
 }
 
@@ -1202,11 +3007,13 @@ int lua_tox_invite_friend(lua_State* L) {
 
 int lua_tox_join_groupchat(lua_State* L) {
     Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
     int32_t friendnumber = luaL_checknumber(L,2);
     uint8_t *friend_group_public_key = (uint8_t*)luaL_checkstring(L,3);
     lua_settop(L,0);
 
     int id = tox_join_groupchat(tox, friendnumber, friend_group_public_key);
+    ltox->dirty |= (id>=0);
     if(id<0)
         lua_pushnil(L);
     else
@@ -1218,7 +3025,7 @@ int lua_tox_group_message_send(lua_State* L) {
     Tox *tox = checkTox(L,1);
     int32_t groupnumber = luaL_checknumber(L,2);
     size_t len;
-    uint8_t *message = (uint8_t*)luaL_checklstring(L,3, &len);
+    uint8_t *message = (uint8_t*)check_data(L, 3, &len);
     lua_settop(L,0);
     int r = tox_group_message_send(tox, groupnumber, message, len);
     lua_pushboolean(L, (r==0));
@@ -1229,7 +3036,7 @@ int lua_tox_group_action_send(lua_State* L) {
     Tox *tox = checkTox(L,1);
     int groupnumber = luaL_checknumber(L,2);
     size_t len;
-    uint8_t *action = (uint8_t*)luaL_checklstring(L,3, &len);
+    uint8_t *action = (uint8_t*)check_data(L, 3, &len);
     lua_settop(L,0);
     int r = tox_group_action_send(tox, groupnumber, action, len);
     lua_pushboolean(L, (r==0));
@@ -1321,7 +3128,7 @@ int lua_tox_file_send_control(lua_State* L) {
     size_t len = 0;
     uint8_t *data = NULL;
     if(! lua_isnoneornil(L,6))
-        data = (uint8_t*)lua_tolstring(L, 6, &len);
+        data = (uint8_t*)opt_data(L, 6, &len);
     lua_settop(L,0);
 
     int r = tox_file_send_control(tox, friendnumber, send_receive, filenumber, message_id, data, len);
@@ -1335,7 +3142,7 @@ int lua_tox_file_send_data(lua_State* L) {
     uint8_t filenumber = luaL_checknumber(L, 3);
     uint8_t length = -1;
     size_t len;
-    uint8_t *data = (uint8_t*)luaL_checklstring(L, 4, &len);
+    uint8_t *data = (uint8_t*)check_data(L, 4, &len);
     if(!lua_isnoneornil(L,5))
         len = luaL_checknumber(L,5);
     lua_settop(L,0);
@@ -1396,11 +3203,410 @@ int lua_tox_do_interval(lua_State* L) {
     return 1;
 }
 
+// work due after each tox_do driven by Lua
+static void ltox_tick(lua_State *L, LTox *ltox) {
+    ++ltox->ticks;
+    outbox_retry(ltox);
+    if(ltox->dirty && ltox->autosave)
+        autosave_tick(ltox, 0);
+    if(ltox->journal)
+        journal_tick(ltox);
+    if(ltox->nb_pending)
+        coalesce_flush(L, ltox, 0);
+    ltox_resume(L, ltox);
+}
+
+static void ltox_kill(lua_State *L, LTox *ltox);
+
+static int ltox_do_protected(lua_State *L) {
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
+    tox_do(ltox->tox);
+    ltox_tick(L, ltox);
+    return 0;
+}
+
+// runs tox_do and the tick; a kill from a callback is deferred until they return,
+// even if a callback raises
+// the callbacks run on ltox->L, so the protected call is made there and
+// an error is handed back to the caller's thread
+static void ltox_do(lua_State *L, LTox *ltox) {
+    lua_State *M = ltox->L;
+    lua_pushcfunction(M, ltox_do_protected);
+    lua_pushlightuserdata(M, ltox);
+    ++ltox->busy;
+    int r = lua_pcall(M, 1, 0, 0);
+    if(r)
+        lua_xmove(M, L, 1);
+    if(--ltox->busy == 0 && ltox->kill_pending)
+        ltox_kill(L, ltox);
+    if(r)
+        lua_error(L);
+}
+
 int lua_tox_do(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    lua_settop(L,1); // keeps the instance alive while it runs
+    ltox_do(L, ltox);
+    return 0;
+}
+
+/**
+ * scheduler shared by run and runAll
+ * instances are kept in a min-heap keyed on their next tox_do deadline,
+ * so only the due ones are serviced on each wake up
+ */
+typedef struct _RunEntry {
+    uint64_t deadline;
+    LTox *ltox;
+} RunEntry;
+
+static void heap_push(RunEntry *heap, int *n, RunEntry e) {
+    int i = (*n)++;
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(heap[parent].deadline <= e.deadline)
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = e;
+}
+
+static RunEntry heap_pop(RunEntry *heap, int *n) {
+    RunEntry top = heap[0];
+    RunEntry last = heap[--(*n)];
+    int i = 0;
+    for(;;) {
+        int child = 2 * i + 1;
+        if(child >= *n)
+            break;
+        if(child + 1 < *n && heap[child+1].deadline < heap[child].deadline)
+            ++child;
+        if(last.deadline <= heap[child].deadline)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if(*n > 0)
+        heap[i] = last;
+    return top;
+}
+
+// ltoxes must stay referenced on the stack while running
+static long ltox_run_loop(lua_State *L, LTox **ltoxes, int count, RunOptions *op) {
+    // heap and due list share one GC-managed block, freed even if a callback raises
+    RunEntry *heap = (RunEntry*)lua_newuserdata(L, 2 * count * sizeof(RunEntry));
+    RunEntry *due = heap + count;
+    int n = 0;
+
+    uint64_t now = ltox_now();
+    for(int i=0;i<count;++i) {
+        RunEntry e = { now, ltoxes[i] };
+        heap_push(heap, &n, e);
+    }
+
+    long iterations = 0;
+    while(n > 0) {
+        ltox_sleep_until(heap[0].deadline);
+
+        now = ltox_now();
+        int nb_due = 0;
+        while(n > 0 && heap[0].deadline <= now)
+            due[nb_due++] = heap_pop(heap, &n);
+
+        for(int i=0;i<nb_due;++i) {
+            LTox *ltox = due[i].ltox;
+            if(ltox->tox == NULL) // killed, drop it
+                continue;
+            uint64_t start = ltox_now();
+            ltox_do(L, ltox);
+            if(ltox->tox == NULL) // killed from a callback
+                continue;
+            due[i].deadline = ltox_next_wake(ltox, start + (uint64_t)tox_do_interval(ltox->tox) * 1000000ULL);
+            heap_push(heap, &n, due[i]);
+        }
+        ++iterations;
+
+        if(op->max_iterations > 0 && iterations >= op->max_iterations)
+            break;
+        if(op->until && ltox_run_until(L, op->until))
+            break;
+    }
+    lua_pop(L,1); // heap
+    return iterations;
+}
+
+// sockets to watch from an external event loop
+int lua_tox_pollfds(lua_State* L) {
     Tox *tox = checkTox(L,1);
     lua_settop(L,0);
-    tox_do(tox);
-    return 0;
+    return push_pollfds(L, tox);
+}
+
+// milliseconds until tox_do should be called again
+// bounded by the binding's own deadlines: parked handlers, coalesced bursts, queue retries, autosave
+int lua_tox_timeout(lua_State* L) {
+    Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
+    lua_settop(L,0);
+    uint64_t now = ltox_now();
+    uint64_t wake = ltox_next_wake(ltox, now + (uint64_t)tox_do_interval(tox) * 1000000ULL);
+    lua_pushnumber(L, wake > now ? (lua_Number)((wake - now) / 1000000ULL) : 0);
+    return 1;
+}
+
+// drives tox_do from C, sleeping until the next deadline between iterations
+int lua_tox_run(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    RunOptions op;
+    checkRunOptions(L, 2, &op);
+
+    long iterations = ltox_run_loop(L, &ltox, 1, &op);
+    lua_settop(L,0);
+    lua_pushnumber(L, iterations);
+    return 1;
+}
+
+// same as run, for an array of Tox instances
+int lua_tox_run_all(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    RunOptions op;
+    checkRunOptions(L, 2, &op);
+
+    int count = lua_objlen(L, 1);
+    if(count == 0) {
+        lua_settop(L,0);
+        lua_pushnumber(L, 0);
+        return 1;
+    }
+
+    // private copy of the array, so instances can't be collected while running
+    lua_createtable(L, count, 0);
+    int refs = lua_gettop(L);
+    LTox **ltoxes = (LTox**)lua_newuserdata(L, count * sizeof(LTox*));
+    for(int i=0;i<count;++i) {
+        lua_rawgeti(L, 1, i+1);
+        ltoxes[i] = checkOwnedLTox(L, -1);
+        lua_rawseti(L, refs, i+1);
+    }
+
+    long iterations = ltox_run_loop(L, ltoxes, count, &op);
+    lua_settop(L,0);
+    lua_pushnumber(L, iterations);
+    return 1;
+}
+
+/**
+ * threaded engine: a native thread owns the Tox instance and runs tox_do on its own schedule
+ * Lua posts commands through a ring buffer and gets events and command results
+ * through the batched events ring; both are single producer single consumer
+ */
+
+// runs the pending commands, on the network thread
+static void thread_run_commands(LTox *ltox) {
+    LToxThread *th = ltox->thread;
+    uint32_t tail = __atomic_load_n(&th->tail, __ATOMIC_ACQUIRE);
+    while(th->head != tail) {
+        LToxCommand *cmd = &th->slots[th->head & (th->capacity - 1)];
+        int64_t r = 0;
+        switch(cmd->type) {
+            case CMD_SEND_MESSAGE:
+                r = ltox_send_chunks(ltox, tox_send_message, cmd->args[0], cmd->data, cmd->len);
+                break;
+            case CMD_SEND_ACTION:
+                r = ltox_send_chunks(ltox, tox_send_action, cmd->args[0], cmd->data, cmd->len);
+                break;
+            case CMD_FILE_SEND_DATA:
+                r = tox_file_send_data(ltox->tox, cmd->args[0], cmd->args[1], cmd->data, cmd->len);
+                break;
+            case CMD_ADD_FRIEND:
+                r = tox_add_friend(ltox->tox, cmd->key, cmd->data, cmd->len);
+                index_put(&ltox->index, cmd->key, (int32_t)r);
+                ltox->dirty |= (r >= 0);
+                if(r >= 0)
+                    journal_append(ltox, JOURNAL_ADD_FRIEND, cmd->key, TOX_FRIEND_ADDRESS_SIZE, cmd->data, cmd->len);
+                break;
+            case CMD_ADD_FRIEND_NOREQUEST:
+                r = tox_add_friend_norequest(ltox->tox, cmd->key);
+                index_put(&ltox->index, cmd->key, (int32_t)r);
+                ltox->dirty |= (r >= 0);
+                if(r >= 0)
+                    journal_append(ltox, JOURNAL_ADD_FRIEND_NOREQUEST, cmd->key, TOX_CLIENT_ID_SIZE, NULL, 0);
+                break;
+        }
+        LToxEvent *ev = events_reserve(ltox->events, EV_COMMAND);
+        if(ev) {
+            ev->args[0] = cmd->id;
+            ev->args[1] = cmd->type;
+            ev->value = (uint64_t)r;
+            events_commit(ltox->events, ev, NULL, 0);
+        }
+        __atomic_store_n(&th->head, th->head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void *thread_main(void *data) {
+    LTox *ltox = (LTox*)data;
+    LToxThread *th = ltox->thread;
+    while(!__atomic_load_n(&th->stop, __ATOMIC_ACQUIRE)) {
+        uint64_t start = ltox_now();
+        thread_run_commands(ltox);
+        tox_do(ltox->tox);
+        outbox_retry(ltox);
+        if(ltox->dirty && ltox->autosave)
+            autosave_tick(ltox, 0);
+        if(ltox->journal)
+            journal_tick(ltox);
+        ltox_sleep_until(start + (uint64_t)tox_do_interval(ltox->tox) * 1000000ULL);
+    }
+    thread_run_commands(ltox); // don't lose what was posted before stopping
+    return NULL;
+}
+
+static void thread_stop(LTox *ltox) {
+    LToxThread *th = ltox->thread;
+    if(!th)
+        return;
+    __atomic_store_n(&th->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(th->id, NULL);
+    for(uint32_t i=0;i<th->capacity;++i)
+        free(th->slots[i].data);
+    free(th->slots);
+    free(th);
+    ltox->thread = NULL;
+}
+
+// tox:startThread{ commands = 256, events = 1024 } hands the instance over to a network thread
+// events are then read with drainEvents, commands are sent with post
+// both capacities are rounded up to a power of 2
+int lua_tox_start_thread(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    uint32_t commands = 256, events = 1024;
+    if(lua_istable(L,2)) {
+        lua_getfield(L, 2, "commands");
+        if(!lua_isnil(L,-1))
+            commands = (uint32_t)luaL_checknumber(L,-1);
+        lua_getfield(L, 2, "events");
+        if(!lua_isnil(L,-1))
+            events = (uint32_t)luaL_checknumber(L,-1);
+    }
+    lua_settop(L,0);
+    if(commands == 0 || events == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Queues can't be empty.");
+        return 2;
+    }
+
+    for(int cb=0;cb<CB_MAX;++cb) {
+        if(!ltox->hooked[cb])
+            ltox_hook(ltox, cb);
+    }
+    if(!ltox->events)
+        ltox->events = events_new(events);
+
+    LToxThread *th = (LToxThread*)calloc(1, sizeof(LToxThread));
+    commands = ring_capacity(commands);
+    th->slots = (LToxCommand*)calloc(commands, sizeof(LToxCommand));
+    th->capacity = commands;
+    ltox->thread = th;
+    if(pthread_create(&th->id, NULL, thread_main, ltox)) {
+        free(th->slots);
+        free(th);
+        ltox->thread = NULL;
+        lua_pushnil(L);
+        lua_pushliteral(L, "Can't start the network thread.");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// waits for the network thread to run the pending commands and exit,
+// Lua drives the instance again afterwards
+int lua_tox_stop_thread(lua_State* L) {
+    LTox *ltox = checkLTox(L,1);
+    lua_settop(L,0);
+    thread_stop(ltox);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// tox:post(command, ...) queues a command for the network thread and returns its id
+// the result comes back as a { "command", id, command, result } event
+// long messages are split as by sendMessage, their result being the receipt of the last chunk
+int lua_tox_post(lua_State* L) {
+    LTox *ltox = checkLTox(L,1);
+    int type = luaL_checkoption(L, 2, NULL, command_names);
+    LToxThread *th = ltox->thread;
+    if(!th) {
+        lua_settop(L,0);
+        lua_pushnil(L);
+        lua_pushliteral(L, "The network thread is not running.");
+        return 2;
+    }
+
+    int32_t args[2] = {0, 0};
+    const uint8_t *key = NULL;
+    size_t key_len = 0, len = 0;
+    const uint8_t *data = NULL;
+    switch(type) {
+        case CMD_SEND_MESSAGE:
+        case CMD_SEND_ACTION:
+            args[0] = luaL_checknumber(L, 3);
+            data = (const uint8_t*)check_data(L, 4, &len);
+            break;
+        case CMD_FILE_SEND_DATA:
+            args[0] = luaL_checknumber(L, 3);
+            args[1] = luaL_checknumber(L, 4);
+            data = (const uint8_t*)check_data(L, 5, &len);
+            break;
+        case CMD_ADD_FRIEND:
+            key = (const uint8_t*)luaL_checklstring(L, 3, &key_len);
+            data = (const uint8_t*)opt_data(L, 4, &len);
+            if(key_len < TOX_FRIEND_ADDRESS_SIZE)
+                return luaL_argerror(L, 3, "invalid address");
+            key_len = TOX_FRIEND_ADDRESS_SIZE;
+            break;
+        case CMD_ADD_FRIEND_NOREQUEST:
+            key = (const uint8_t*)luaL_checklstring(L, 3, &key_len);
+            if(key_len < TOX_CLIENT_ID_SIZE)
+                return luaL_argerror(L, 3, "invalid client id");
+            key_len = TOX_CLIENT_ID_SIZE;
+            break;
+    }
+
+    if(th->tail - __atomic_load_n(&th->head, __ATOMIC_ACQUIRE) >= th->capacity) {
+        lua_settop(L,0);
+        lua_pushnil(L);
+        lua_pushliteral(L, "Command queue is full.");
+        return 2;
+    }
+    LToxCommand *cmd = &th->slots[th->tail & (th->capacity - 1)];
+    if(len > cmd->size) {
+        uint8_t *p = (uint8_t*)realloc(cmd->data, len);
+        if(!p) {
+            lua_settop(L,0);
+            lua_pushnil(L);
+            lua_pushliteral(L, "Can't allocate command.");
+            return 2;
+        }
+        cmd->data = p;
+        cmd->size = len;
+    }
+    cmd->type = type;
+    cmd->id = ++th->next_id;
+    cmd->args[0] = args[0];
+    cmd->args[1] = args[1];
+    if(key)
+        memcpy(cmd->key, key, key_len);
+    if(len)
+        memcpy(cmd->data, data, len);
+    cmd->len = len;
+    __atomic_store_n(&th->tail, th->tail + 1, __ATOMIC_RELEASE);
+
+    lua_settop(L,0);
+    lua_pushnumber(L, cmd->id);
+    return 1;
 }
 
 int lua_tox_size(lua_State* L) {
@@ -1410,22 +3616,682 @@ int lua_tox_size(lua_State* L) {
     return 1;
 }
 
+// tox:save([buffer]) returns the state as a string, or in buffer if one is given
 int lua_tox_save(lua_State* L) {
     Tox *tox = checkTox(L,1);
+    LToxBuffer *b = lua_isnoneornil(L,2) ? NULL : check_buffer(L,2);
+    if(b) {
+        uint32_t size = tox_size(tox);
+        lua_settop(L,2);
+        if(size > b->capacity) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "Buffer is too small (%d < %d).", (int)b->capacity, (int)size);
+            return 2;
+        }
+        tox_save(tox, b->data);
+        b->len = size;
+        return 1;
+    }
     lua_settop(L,0);
     uint32_t size = tox_size(tox);
-    uint8_t data[size];
+    uint8_t *data = (uint8_t*)malloc(size ? size : 1);
+    if(!data)
+        return luaL_error(L, "Can't allocate %d bytes to save tox.", (int)size);
     tox_save(tox, data);
     lua_pushlstring(L, (char*)data, size);
+    free(data);
+    return 1;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t len) {
+    while(len) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// syncs the directory of path, so that a rename into it survives a crash
+static int sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    char *dir = (char*)malloc(len + 2);
+    if(!dir)
+        return -1;
+    if(slash && len == 0)
+        strcpy(dir, "/");
+    else if(slash) {
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+    else
+        strcpy(dir, ".");
+    int fd = open(dir, O_RDONLY);
+    free(dir);
+    if(fd < 0)
+        return -1;
+    int r = fsync(fd);
+    close(fd);
+    return r;
+}
+
+// writes data to a temporary file next to path and renames it over path
+// returns 0, or errno on failure, the previous file being left untouched
+static int write_file(const char *path, const uint8_t *data, size_t len, int sync) {
+    size_t plen = strlen(path);
+    char *tmp = (char*)malloc(plen + 8);
+    if(!tmp)
+        return ENOMEM;
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".XXXXXX", 8);
+    int fd = mkstemp(tmp); // 0600, the data holds the private key
+    if(fd < 0) {
+        int err = errno;
+        free(tmp);
+        return err;
+    }
+    int r = write_all(fd, data, len);
+    if(r == 0 && sync)
+        r = fsync(fd);
+    int err = r ? errno : 0;
+    if(close(fd) && !err)
+        err = errno;
+    if(!err && rename(tmp, path))
+        err = errno;
+    if(err)
+        unlink(tmp);
+    else if(sync && sync_dir(path))
+        err = errno;
+    free(tmp);
+    return err;
+}
+
+// hands a read only mapping of path to tox_load, then replays the journal of path
+// returns 0, errno on failure, or -1 if tox rejected the data
+static int load_file(LTox *ltox, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return errno;
+    struct stat st;
+    if(fstat(fd, &st)) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    if(st.st_size == 0 || (uint64_t)st.st_size > UINT32_MAX) {
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = (data == MAP_FAILED) ? errno : 0;
+    close(fd);
+    if(err)
+        return err;
+    int r = tox_load(ltox->tox, (uint8_t*)data, (uint32_t)st.st_size);
+    munmap(data, st.st_size);
+    ltox->index.stale = 1;
+    if(r)
+        return -1;
+    return journal_replay(ltox, path);
+}
+
+static void push_load_error(lua_State *L, const char *path, int err) {
+    if(err < 0)
+        lua_pushfstring(L, "Can't load '%s': invalid tox data", path);
+    else
+        lua_pushfstring(L, "Can't load '%s': %s", path, strerror(err));
+}
+
+// tox:loadFromFile(path) loads tox from path without reading it into Lua
+// returns true, or nil and an error message
+int lua_tox_load_from_file(lua_State* L) {
+    checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
+    const char *path = luaL_checkstring(L,2);
+    int err = load_file(ltox, path);
+    if(err) {
+        lua_pushnil(L);
+        push_load_error(L, path, err);
+        return 2;
+    }
+    lua_settop(L,0);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// whether a and b name the same file, as far as can be told before they exist
+static int same_file(const char *a, const char *b) {
+    if(!strcmp(a, b))
+        return 1;
+    struct stat sa, sb;
+    return !stat(a, &sa) && !stat(b, &sb) && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/**
+ * autosave: when the state changed and the interval elapsed, the thread that owns tox
+ * serializes it into whichever of the two buffers the writer isn't busy with, and the writer
+ * thread saves it with write_file; a snapshot not picked up yet is replaced by the next one
+ */
+static void *autosave_main(void *data) {
+    LToxAutosave *as = (LToxAutosave*)data;
+    pthread_mutex_lock(&as->lock);
+    for(;;) {
+        while(as->ready < 0 && !as->stop)
+            pthread_cond_wait(&as->cond, &as->lock);
+        if(as->ready < 0)
+            break; // stopped, and nothing left to save
+        int b = as->writing = as->ready;
+        as->ready = -1;
+        pthread_mutex_unlock(&as->lock);
+        int err = write_file(as->path, as->buffers[b], as->sizes[b], as->sync);
+        pthread_mutex_lock(&as->lock);
+        as->writing = -1;
+        as->error = err;
+        if(!err)
+            ++as->saves;
+    }
+    pthread_mutex_unlock(&as->lock);
+    return NULL;
+}
+
+// snapshots tox for the writer if it changed and the interval elapsed, or now if force is set
+static void autosave_tick(LTox *ltox, int force) {
+    LToxAutosave *as = ltox->autosave;
+    uint64_t now = ltox_now();
+    if(!ltox->dirty || (!force && now < as->last + as->interval))
+        return;
+
+    pthread_mutex_lock(&as->lock);
+    int b = (as->writing == 0) ? 1 : 0;
+    as->ready = -1; // the writer mustn't take b while it's being filled
+    pthread_mutex_unlock(&as->lock);
+
+    uint32_t size = tox_size(ltox->tox);
+    if(size > as->capacities[b]) {
+        uint8_t *buffer = (uint8_t*)realloc(as->buffers[b], size);
+        if(!buffer) {
+            pthread_mutex_lock(&as->lock);
+            as->error = ENOMEM;
+            pthread_mutex_unlock(&as->lock);
+            return; // still dirty, retried on the next interval
+        }
+        as->buffers[b] = buffer;
+        as->capacities[b] = size;
+    }
+    tox_save(ltox->tox, as->buffers[b]);
+    as->sizes[b] = size;
+    as->last = now;
+    ltox->dirty = 0;
+
+    pthread_mutex_lock(&as->lock);
+    as->ready = b;
+    pthread_cond_signal(&as->cond);
+    pthread_mutex_unlock(&as->lock);
+}
+
+// takes a last snapshot if needed, and waits for the writer to save it
+static void autosave_stop(LTox *ltox) {
+    LToxAutosave *as = ltox->autosave;
+    if(!as)
+        return;
+    autosave_tick(ltox, 1);
+    pthread_mutex_lock(&as->lock);
+    as->stop = 1;
+    pthread_cond_signal(&as->cond);
+    pthread_mutex_unlock(&as->lock);
+    pthread_join(as->id, NULL);
+    pthread_cond_destroy(&as->cond);
+    pthread_mutex_destroy(&as->lock);
+    free(as->buffers[0]);
+    free(as->buffers[1]);
+    free(as->path);
+    free(as);
+    ltox->autosave = NULL;
+}
+
+// tox:autosave(path, [{ interval = ms, fsync = boolean }]) saves tox to path in the background,
+// at most once per interval (5000 ms by default) and only when it changed; tox:autosave(false)
+// saves what's pending and stops
+// the path of the journal is refused (see tox:journal)
+int lua_tox_autosave(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    if(lua_isboolean(L,2) && !lua_toboolean(L,2)) {
+        lua_settop(L,0);
+        autosave_stop(ltox);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    const char *path = luaL_checkstring(L,2);
+    double interval = 5000;
+    int sync = 0;
+    if(lua_istable(L,3)) {
+        lua_getfield(L, 3, "interval");
+        if(!lua_isnil(L,-1))
+            interval = luaL_checknumber(L,-1);
+        lua_getfield(L, 3, "fsync");
+        sync = lua_toboolean(L,-1);
+        lua_pop(L,2);
+    }
+    if(ltox->journal && same_file(ltox->journal->path, path)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "The journal already saves to this path.");
+        return 2;
+    }
+    autosave_stop(ltox);
+
+    LToxAutosave *as = (LToxAutosave*)calloc(1, sizeof(LToxAutosave));
+    if(as)
+        as->path = strdup(path);
+    if(!as || !as->path) {
+        free(as);
+        return luaL_error(L, "Can't allocate autosave.");
+    }
+    as->sync = sync;
+    as->interval = (uint64_t)(interval * 1000000.0);
+    as->last = ltox_now();
+    as->ready = as->writing = -1;
+    pthread_mutex_init(&as->lock, NULL);
+    pthread_cond_init(&as->cond, NULL);
+    if(pthread_create(&as->id, NULL, autosave_main, as)) {
+        pthread_cond_destroy(&as->cond);
+        pthread_mutex_destroy(&as->lock);
+        free(as->path);
+        free(as);
+        lua_pushnil(L);
+        lua_pushliteral(L, "Can't start the autosave thread.");
+        return 2;
+    }
+    ltox->autosave = as;
+    lua_settop(L,0);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// tox:autosaveStatus() returns { dirty = boolean, saves = number, error = message or nil },
+// or nil if autosave is disabled
+// dirty is written by the network thread, so this needs the instance back from it
+int lua_tox_autosave_status(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    lua_settop(L,0);
+    LToxAutosave *as = ltox->autosave;
+    if(!as) {
+        lua_pushnil(L);
+        return 1;
+    }
+    pthread_mutex_lock(&as->lock);
+    uint32_t saves = as->saves;
+    int pending = (as->ready >= 0 || as->writing >= 0);
+    int err = as->error;
+    pthread_mutex_unlock(&as->lock);
+
+    lua_createtable(L, 0, 3);
+    lua_pushboolean(L, ltox->dirty || pending);
+    lua_setfield(L, -2, "dirty");
+    lua_pushnumber(L, saves);
+    lua_setfield(L, -2, "saves");
+    if(err) {
+        lua_pushstring(L, strerror(err));
+        lua_setfield(L, -2, "error");
+    }
+    return 1;
+}
+
+/**
+ * journal: the mutating calls append small records to path..".journal", synced in batches,
+ * and loading path replays them on top of it; past a number of records, the journal is
+ * compacted into a full save of path
+ * a record is a type byte, a little endian 16 bits length, the data and its FNV-1a hash,
+ * replay stops at the first torn or corrupted record
+ */
+#define JOURNAL_MAX_RECORD 2048
+
+static uint32_t journal_hash(const uint8_t *data, size_t len) {
+    uint32_t h = 2166136261U;
+    for(size_t i=0;i<len;++i)
+        h = (h ^ data[i]) * 16777619U;
+    return h;
+}
+
+static char *journal_path(const char *path) {
+    size_t len = strlen(path);
+    char *jpath = (char*)malloc(len + sizeof(".journal"));
+    if(jpath) {
+        memcpy(jpath, path, len);
+        memcpy(jpath + len, ".journal", sizeof(".journal"));
+    }
+    return jpath;
+}
+
+// records after a lost one would be skipped by the replay: stops appending until
+// a compaction saves the whole state again
+static void journal_fail(LToxJournal *j, int err) {
+    j->failed = 1;
+    j->error = err;
+    ++j->errors;
+}
+
+static void journal_sync(LToxJournal *j) {
+    if(!j->unsynced)
+        return;
+    if(fsync(j->fd))
+        journal_fail(j, errno);
+    j->unsynced = 0;
+    j->last_sync = ltox_now();
+}
+
+static void journal_append(LTox *ltox, int type, const uint8_t *data, size_t len, const uint8_t *more, size_t more_len) {
+    LToxJournal *j = ltox->journal;
+    if(!j || j->failed)
+        return;
+    uint8_t record[JOURNAL_MAX_RECORD];
+    size_t size = len + more_len;
+    if(size + 7 > sizeof(record)) {
+        journal_fail(j, EMSGSIZE);
+        return;
+    }
+    record[0] = type;
+    record[1] = size & 0xff;
+    record[2] = size >> 8;
+    if(len)
+        memcpy(record + 3, data, len);
+    if(more_len)
+        memcpy(record + 3 + len, more, more_len);
+    uint32_t h = journal_hash(record, size + 3);
+    for(int i=0;i<4;++i)
+        record[size + 3 + i] = (h >> (8*i)) & 0xff;
+    if(write_all(j->fd, record, size + 7)) {
+        journal_fail(j, errno);
+        return;
+    }
+    ++j->records;
+    ++j->unsynced;
+    if(!j->interval)
+        journal_sync(j);
+}
+
+// replaces the journal with a full save
+static int journal_compact(LTox *ltox) {
+    LToxJournal *j = ltox->journal;
+    uint32_t size = tox_size(ltox->tox);
+    uint8_t *data = (uint8_t*)malloc(size ? size : 1);
+    int err = data ? 0 : ENOMEM;
+    if(data) {
+        tox_save(ltox->tox, data);
+        err = write_file(j->path, data, size, 1);
+        free(data);
+    }
+    if(!err && (ftruncate(j->fd, 0) || fsync(j->fd)))
+        err = errno;
+    j->last_sync = ltox_now();
+    if(err) {
+        journal_fail(j, err);
+        return err;
+    }
+    j->records = j->unsynced = 0;
+    j->failed = 0;
+    return 0;
+}
+
+#define JOURNAL_RETRY 1000000000ULL // ns between compactions of a failed journal
+
+static void journal_tick(LTox *ltox) {
+    LToxJournal *j = ltox->journal;
+    if(j->failed) {
+        if(ltox_now() >= j->last_sync + JOURNAL_RETRY)
+            journal_compact(ltox);
+    }
+    else if(j->compact && j->records >= j->compact)
+        journal_compact(ltox);
+    else if(j->unsynced && ltox_now() >= j->last_sync + j->interval)
+        journal_sync(j);
+}
+
+static void journal_stop(LTox *ltox) {
+    LToxJournal *j = ltox->journal;
+    if(!j)
+        return;
+    if(j->failed)
+        journal_compact(ltox);
+    journal_sync(j);
+    close(j->fd);
+    free(j->path);
+    free(j);
+    ltox->journal = NULL;
+}
+
+static void journal_apply(Tox *tox, int type, const uint8_t *data, size_t len) {
+    switch(type) {
+        case JOURNAL_ADD_FRIEND: // the request went out when it was journaled, don't send it again
+            if(len >= TOX_FRIEND_ADDRESS_SIZE)
+                tox_add_friend_norequest(tox, data);
+            break;
+        case JOURNAL_ADD_FRIEND_NOREQUEST:
+            if(len == TOX_CLIENT_ID_SIZE)
+                tox_add_friend_norequest(tox, data);
+            break;
+        case JOURNAL_DEL_FRIEND:
+            if(len == TOX_CLIENT_ID_SIZE) {
+                int32_t friendnumber = tox_get_friend_number(tox, data);
+                if(friendnumber >= 0)
+                    tox_del_friend(tox, friendnumber);
+            }
+            break;
+        case JOURNAL_NAME:
+            tox_set_name(tox, data, len);
+            break;
+        case JOURNAL_STATUS_MESSAGE:
+            tox_set_status_message(tox, data, len);
+            break;
+        case JOURNAL_USER_STATUS:
+            if(len == 1)
+                tox_set_user_status(tox, data[0]);
+            break;
+        case JOURNAL_NOSPAM:
+            if(len == 4)
+                tox_set_nospam(tox, data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+            break;
+    }
+}
+
+// replays the journal of path, if any; returns 0 or errno
+static int journal_replay(LTox *ltox, const char *path) {
+    char *jpath = journal_path(path);
+    if(!jpath)
+        return ENOMEM;
+    int fd = open(jpath, O_RDONLY);
+    free(jpath);
+    if(fd < 0)
+        return (errno == ENOENT) ? 0 : errno;
+    struct stat st;
+    if(fstat(fd, &st)) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    if(st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    const uint8_t *data = (const uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = (data == MAP_FAILED) ? errno : 0;
+    close(fd);
+    if(err)
+        return err;
+    size_t pos = 0;
+    while(pos + 7 <= (size_t)st.st_size) {
+        size_t len = data[pos+1] | data[pos+2] << 8;
+        if(pos + len + 7 > (size_t)st.st_size)
+            break;
+        const uint8_t *h = data + pos + 3 + len;
+        uint32_t check = h[0] | h[1] << 8 | h[2] << 16 | (uint32_t)h[3] << 24;
+        if(check != journal_hash(data + pos, len + 3))
+            break;
+        journal_apply(ltox->tox, data[pos], data + pos + 3, len);
+        pos += len + 7;
+    }
+    munmap((void*)data, st.st_size);
+    ltox->dirty = 1;
+    return 0;
+}
+
+// tox:journal(path, [{ syncInterval = ms, compact = records }]) saves tox to path, then logs
+// its changes to path..".journal", synced every syncInterval ms (1000 by default, 0 syncs each
+// record) and compacted into path every compact records (1024 by default, 0 for never);
+// tox:journal(false) syncs and closes the journal
+// returns true, or nil and an error message
+// autosave and the journal can't share a path, since an autosave landing after a compaction
+// would put an older base under the journal: whichever is set up first keeps the path
+// saveToFile to the journal's path compacts the journal, for the same reason
+int lua_tox_journal(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    if(lua_isboolean(L,2) && !lua_toboolean(L,2)) {
+        lua_settop(L,0);
+        journal_stop(ltox);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    const char *path = luaL_checkstring(L,2);
+    double interval = 1000;
+    uint32_t compact = 1024;
+    if(lua_istable(L,3)) {
+        lua_getfield(L, 3, "syncInterval");
+        if(!lua_isnil(L,-1))
+            interval = luaL_checknumber(L,-1);
+        lua_getfield(L, 3, "compact");
+        if(!lua_isnil(L,-1))
+            compact = (uint32_t)luaL_checknumber(L,-1);
+        lua_pop(L,2);
+    }
+    if(ltox->autosave && same_file(ltox->autosave->path, path)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Autosave already saves to this path.");
+        return 2;
+    }
+    journal_stop(ltox);
+
+    LToxJournal *j = (LToxJournal*)calloc(1, sizeof(LToxJournal));
+    char *jpath = NULL;
+    if(j) {
+        j->path = strdup(path);
+        jpath = journal_path(path);
+    }
+    if(!j || !j->path || !jpath) {
+        if(j)
+            free(j->path);
+        free(j);
+        free(jpath);
+        return luaL_error(L, "Can't allocate journal.");
+    }
+    j->fd = open(jpath, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    free(jpath);
+    if(j->fd < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Can't open the journal of '%s': %s", path, strerror(errno));
+        free(j->path);
+        free(j);
+        return 2;
+    }
+    j->compact = compact;
+    j->interval = (uint64_t)(interval * 1000000.0);
+    ltox->journal = j;
+
+    // start from a full save, records left by a previous run being part of tox by now
+    int err = journal_compact(ltox);
+    if(err) {
+        journal_stop(ltox);
+        lua_pushnil(L);
+        lua_pushfstring(L, "Can't save to '%s': %s", path, strerror(err));
+        return 2;
+    }
+    lua_settop(L,0);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// tox:journalStatus() returns { records = number, unsynced = number, failed = boolean,
+// errors = number, error = message of the last failure or nil }, or nil if there's no journal
+// a failed journal has lost a record and takes no more until the next compaction, retried each second
+int lua_tox_journal_status(lua_State* L) {
+    LTox *ltox = checkOwnedLTox(L,1);
+    lua_settop(L,0);
+    LToxJournal *j = ltox->journal;
+    if(!j) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, j->records);
+    lua_setfield(L, -2, "records");
+    lua_pushnumber(L, j->unsynced);
+    lua_setfield(L, -2, "unsynced");
+    lua_pushboolean(L, j->failed);
+    lua_setfield(L, -2, "failed");
+    lua_pushnumber(L, j->errors);
+    lua_setfield(L, -2, "errors");
+    if(j->error) {
+        lua_pushstring(L, strerror(j->error));
+        lua_setfield(L, -2, "error");
+    }
+    return 1;
+}
+
+// tox:saveToFile(path, [{ fsync = boolean }]) saves tox to path atomically
+// returns true, or nil and an error message
+int lua_tox_save_to_file(lua_State* L) {
+    Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
+    const char *path = luaL_checkstring(L,2);
+    int sync = 0;
+    if(lua_istable(L,3)) {
+        lua_getfield(L, 3, "fsync");
+        sync = lua_toboolean(L,-1);
+        lua_pop(L,1);
+    }
+    if(ltox->journal && same_file(ltox->journal->path, path)) {
+        int err = journal_compact(ltox);
+        if(err) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "Can't save to '%s': %s", path, strerror(err));
+            return 2;
+        }
+        lua_settop(L,0);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    uint32_t size = tox_size(tox);
+    uint8_t *data = (uint8_t*)malloc(size ? size : 1);
+    if(!data) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Can't allocate %d bytes to save tox.", (int)size);
+        return 2;
+    }
+    tox_save(tox, data);
+    int err = write_file(path, data, size, sync);
+    free(data);
+    if(err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Can't save to '%s': %s", path, strerror(err));
+        return 2;
+    }
+    lua_settop(L,0);
+    lua_pushboolean(L, 1);
     return 1;
 }
 
 int lua_tox_load(lua_State* L) {
     Tox *tox = checkTox(L,1);
+    LTox *ltox = (LTox*)lua_touserdata(L,1);
     size_t len;
-    uint8_t *data = (uint8_t*)luaL_checklstring(L, 2, &len);
+    uint8_t *data = (uint8_t*)check_data(L, 2, &len);
     lua_settop(L,0);
     int r = tox_load(tox, data, len);
+    ltox->index.stale = 1; // friends come from the data
     lua_pushboolean(L, (r==0));
     return 1;
 }
@@ -1443,39 +4309,62 @@ int lua_tox_gc(lua_State* L) {
     LTox *ltox = (LTox*)lua_touserdata(L, 1);
     if (ltox == NULL)
         return 0;
-    Tox *tox = ltox->tox;
-    if (tox == NULL)
+    if (ltox->tox == NULL)
+        return 0;
+    if (ltox->busy) { // called from a callback, tox_do is still running
+        ltox->kill_pending = 1;
         return 0;
+    }
 
     lua_settop(L,0);
+    ltox_kill(L, ltox);
+    return 0;
+}
 
-    // get associated table
-    lua_pushlightuserdata(L, (void*)tox);
-    lua_gettable(L, LUA_REGISTRYINDEX);
-    if(! lua_isnil(L,-1)) {
-        // free callbacks datum
-        lua_getfield(L, -1, "userdata");
-        if ( ! lua_isnil(L, -1) ) {
-            lua_pushnil(L);
-            while(lua_next(L, -2)) {
-                LObj *obj = (LObj*)lua_topointer(L,-1);
-                if(obj)
-                    free(obj);
-                lua_pushnil(L);
-                lua_rawset(L, -4);
-            }
-        }
-        lua_pop(L,1);
+static void ltox_kill(lua_State *L, LTox *ltox) {
+    Tox *tox = ltox->tox;
+    ltox->kill_pending = 0;
+    thread_stop(ltox);
+    autosave_stop(ltox);
+    journal_stop(ltox);
+    outbox_free(ltox);
+    receipts_free(ltox->receipts);
+    ltox->receipts = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, ltox->receive_ref);
+    ltox->receive_ref = LUA_NOREF;
+    ltox->receive = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, ltox->coalesced);
+    ltox->coalesced = LUA_NOREF;
+    free(ltox->pending);
+    ltox->pending = NULL;
+    ltox->nb_pending = ltox->max_pending = 0;
+    index_free(&ltox->index);
+    free(ltox->presence);
+    free(ltox->changed);
+    ltox->presence = NULL;
+    ltox->changed = NULL;
+    ltox->nb_presence = ltox->nb_changed = 0;
+
+    for(int i=0;i<CB_MAX;++i) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ltox->callbacks[i]);
+        luaL_unref(L, LUA_REGISTRYINDEX, ltox->userdata[i]);
+        ltox->callbacks[i] = LUA_NOREF;
+        ltox->userdata[i] = LUA_NOREF;
     }
-    lua_pop(L,1);
+    events_free(ltox->events);
+    ltox->events = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, ltox->errors);
+    ltox->errors = LUA_NOREF;
+    while(ltox->nb_tasks)
+        task_remove(L, ltox, 0);
+    free(ltox->tasks);
+    ltox->tasks = NULL;
+    ltox->max_tasks = 0;
 
-    unreg(L, ltox);
-    unreg(L, tox);
     if(tox!=NULL) {
         tox_kill( tox );
         ltox->tox = NULL;
     }
-    return 0;
 }
 
 static int lua_tox_tostring(lua_State* L) {
@@ -1490,25 +4379,68 @@ static void ltox_init(lua_State *L, int index) {
     checkToxOptions(L, index, &op);
 
     LTox *ltox = pushTox(L, &op);
-    ltox->callbacks.friend_request = 0;
-    ltox->callbacks.friend_message = 0;
-    ltox->callbacks.friend_action = 0;
-    ltox->callbacks.name_change = 0;
-    ltox->callbacks.status_message = 0;
-    ltox->callbacks.user_status = 0;
-    ltox->callbacks.typing_change = 0;
-    ltox->callbacks.read_receipt = 0;
-    ltox->callbacks.connection_status = 0;
-    ltox->callbacks.group_invite = 0;
-    ltox->callbacks.group_message = 0;
-    ltox->callbacks.group_action = 0;
-    ltox->callbacks.group_namelist_change = 0;
-    ltox->callbacks.file_send_request = 0;
-    ltox->callbacks.file_control = 0;
-    ltox->callbacks.file_data = 0;
-
-    reg(L, ltox);
-    reg(L, ltox->tox);
+    for(int i=0;i<CB_MAX;++i) {
+        ltox->callbacks[i] = LUA_NOREF;
+        ltox->userdata[i] = LUA_NOREF;
+        ltox->hooked[i] = 0;
+    }
+    ltox->events = NULL;
+    ltox->errors = LUA_NOREF;
+    ltox->nb_errors = 0;
+    ltox->max_errors = 0;
+    ltox->errors_dropped = 0;
+    ltox->coroutines = 0;
+    ltox->resuming = 0;
+    ltox->tasks = NULL;
+    ltox->nb_tasks = 0;
+    ltox->max_tasks = 0;
+    ltox->thread = NULL;
+    ltox->outboxes = NULL;
+    ltox->nb_outboxes = 0;
+    ltox->queued = 0;
+    ltox->max_queued = 64;
+    ltox->receipts = NULL;
+    ltox->receive = NULL;
+    ltox->receive_ref = LUA_NOREF;
+    ltox->ticks = 0;
+    ltox->coalesce_ticks = 0;
+    ltox->coalesce_ms = 0;
+    ltox->coalesced = LUA_NOREF;
+    ltox->pending = NULL;
+    ltox->nb_pending = 0;
+    ltox->max_pending = 0;
+    ltox->index.slots = NULL;
+    ltox->index.capacity = 0;
+    ltox->index.count = 0;
+    ltox->index.stale = 1;
+    ltox->presence = NULL;
+    ltox->changed = NULL;
+    ltox->nb_presence = 0;
+    ltox->nb_changed = 0;
+    ltox->dirty = 0;
+    ltox->autosave = NULL;
+    ltox->journal = NULL;
+    ltox->busy = 0;
+    ltox->kill_pending = 0;
+
+    // the presence log is fed whether Lua handles these or not
+    ltox_hook(ltox, CB_CONNECTION_STATUS);
+    ltox_hook(ltox, CB_USER_STATUS);
+    ltox_hook(ltox, CB_NAME_CHANGE);
+    ltox_hook(ltox, CB_STATUS_MESSAGE);
+
+    if(lua_istable(L, index)) {
+        lua_getfield(L, index, "load_file");
+        if(!lua_isnil(L, -1)) {
+            const char *path = luaL_checkstring(L, -1);
+            int err = load_file(ltox, path);
+            if(err) {
+                push_load_error(L, path, err);
+                lua_error(L);
+            }
+        }
+        lua_pop(L, 1);
+    }
 }
 
 int lua_tox_new(lua_State* L) {
@@ -1524,11 +4456,13 @@ static int lua_tox_new_meta(lua_State* L) {
 // TODO: improve: set methods only when new is called
 static const luaL_Reg tox_methods[] = {
     {"new", lua_tox_new},
+    {"buffer", lua_buffer_new},
 
     {"getAddress", lua_tox_get_address},
     {"addFriend", lua_tox_add_friend},
     {"addFriendByString", lua_tox_add_friend_string},
     {"addFriendNorequest", lua_tox_add_friend_norequest},
+    {"addFriendsNorequest", lua_tox_add_friends_norequest},
     {"getFriendNumber", lua_tox_get_friend_number},
     {"getClientId", lua_tox_get_client_id},
     {"delFriend", lua_tox_del_friend},
@@ -1537,6 +4471,14 @@ static const luaL_Reg tox_methods[] = {
     {"friendExists", lua_tox_friend_exists},
     {"sendMessage", lua_tox_send_message},
     {"sendAction", lua_tox_send_action},
+    {"broadcastMessage", lua_tox_broadcast_message},
+    {"queueMessage", lua_tox_queue_message},
+    {"queueAction", lua_tox_queue_action},
+    {"queueDepth", lua_tox_queue_depth},
+    {"setQueueLimit", lua_tox_set_queue_limit},
+    {"trackReceipts", lua_tox_track_receipts},
+    {"receiptStats", lua_tox_receipt_stats},
+    {"sweepReceipts", lua_tox_sweep_receipts},
     {"setName", lua_tox_set_name},
     {"getSelfName", lua_tox_get_self_name},
     {"getName", lua_tox_get_name},
@@ -1556,6 +4498,17 @@ static const luaL_Reg tox_methods[] = {
     {"countFriendlist", lua_tox_count_friendlist},
     {"getNumOnlineFriends", lua_tox_get_num_online_friends},
     {"getFriendlist", lua_tox_get_friendlist},
+    {"friends", lua_tox_friends},
+    {"getFriendsSnapshot", lua_tox_get_friends_snapshot},
+    {"pollPresenceChanges", lua_tox_poll_presence_changes},
+    {"on", lua_tox_on},
+    {"batchEvents", lua_tox_batch_events},
+    {"drainEvents", lua_tox_drain_events},
+    {"isolateErrors", lua_tox_isolate_errors},
+    {"errors", lua_tox_errors},
+    {"useCoroutines", lua_tox_use_coroutines},
+    {"receiveInto", lua_tox_receive_into},
+    {"coalesceMessages", lua_tox_coalesce_messages},
     {"callbackFriendRequest", lua_tox_callback_friend_request},
     {"callbackFriendMessage", lua_tox_callback_friend_message},
     {"callbackFriendAction", lua_tox_callback_friend_action},
@@ -1595,9 +4548,22 @@ static const luaL_Reg tox_methods[] = {
 
     {"toxDoInterval", lua_tox_do_interval},
     {"toxDo", lua_tox_do},
+    {"run", lua_tox_run},
+    {"runAll", lua_tox_run_all},
+    {"startThread", lua_tox_start_thread},
+    {"stopThread", lua_tox_stop_thread},
+    {"post", lua_tox_post},
+    {"pollfds", lua_tox_pollfds},
+    {"timeout", lua_tox_timeout},
     {"size", lua_tox_size},
     {"save", lua_tox_save},
     {"load", lua_tox_load},
+    {"saveToFile", lua_tox_save_to_file},
+    {"loadFromFile", lua_tox_load_from_file},
+    {"autosave", lua_tox_autosave},
+    {"autosaveStatus", lua_tox_autosave_status},
+    {"journal", lua_tox_journal},
+    {"journalStatus", lua_tox_journal_status},
 
     {"kill", lua_tox_gc},
     {NULL,NULL}
@@ -1616,7 +4582,8 @@ static const luaL_Reg class_meta[] = {
 };
 
 int lua_tox_register(lua_State* L) {
-    Ls = L;
+    main_thread(L); // keep the main thread while we're most likely running on it
+    register_buffer(L);
     lua_newtable(L);
     // lua 5.2's luaL_setfuncs light emulation
     for(int f = 0; tox_methods[f].name != NULL; ++f) {
@@ -27,68 +27,31 @@
 #define MAX_STR_SIZE 256
 
 #include <stdint.h>
+#include <pthread.h>
 
 #include "lua_common.h"
 
-typedef struct _callbacks_t {
-    int friend_request;
-    int friend_message;
-    int friend_action;
-    int name_change;
-    int status_message;
-    int user_status;
-    int typing_change;
-    int read_receipt;
-    int connection_status;
-    int group_invite;
-    int group_message;
-    int group_action;
-    int group_namelist_change;
-    int file_send_request;
-    int file_control;
-    int file_data;
-} callbacks_t;
-
-/*
+// slots of the per-instance callback dispatch array
 enum callback_n {
-    friend_request,
-    friend_message,
-    friend_action,
-    name_change,
-    status_message,
-    user_status,
-    typing_change,
-    read_receipt,
-    connection_status,
-    group_invite,
-    group_message,
-    group_action,
-    group_namelist_change,
-    file_send_request,
-    file_control,
-    file_data
+    CB_FRIEND_REQUEST,
+    CB_FRIEND_MESSAGE,
+    CB_FRIEND_ACTION,
+    CB_NAME_CHANGE,
+    CB_STATUS_MESSAGE,
+    CB_USER_STATUS,
+    CB_TYPING_CHANGE,
+    CB_READ_RECEIPT,
+    CB_CONNECTION_STATUS,
+    CB_GROUP_INVITE,
+    CB_GROUP_MESSAGE,
+    CB_GROUP_ACTION,
+    CB_GROUP_NAMELIST_CHANGE,
+    CB_FILE_SEND_REQUEST,
+    CB_FILE_CONTROL,
+    CB_FILE_DATA,
+    CB_MAX
 };
 
-static const char *callback_nanes[] = {
-    "friend_request",
-    "friend_message",
-    "friend_action",
-    "name_change",
-    "status_message",
-    "user_status",
-    "typing_change",
-    "read_receipt",
-    "connection_status",
-    "group_invite",
-    "group_message",
-    "group_action",
-    "group_namelist_change",
-    "file_send_request",
-    "file_control",
-    "file_data"
-};
-*/
-
 #include "tox/tox.h"
 #include "lua.h"
 #include "lauxlib.h"
@@ -98,15 +61,216 @@ static const char *callback_nanes[] = {
 extern "C" {
 #endif
 
+// compact record of an event, for batched delivery
+typedef struct _LToxEvent {
+    int type;               // CB_*
+    int32_t args[4];
+    uint64_t value;         // receipt or file size
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+    uint8_t *data;          // payload, reused by the slot
+    uint32_t len;
+    uint32_t size;
+} LToxEvent;
+
+typedef struct _LToxEvents {
+    LToxEvent *slots;
+    uint32_t capacity;      // power of 2
+    uint32_t head;          // next event to read
+    uint32_t tail;          // next slot to write
+    uint32_t dropped;       // events lost because the ring was full
+} LToxEvents;
+
+// a command queued for the network thread
+typedef struct _LToxCommand {
+    int type;               // CMD_*
+    uint32_t id;
+    int32_t args[2];
+    uint8_t key[TOX_FRIEND_ADDRESS_SIZE];
+    uint8_t *data;          // payload, reused by the slot
+    uint32_t len;
+    uint32_t size;
+} LToxCommand;
+
+// network thread owning the Tox instance, fed through a single producer single consumer ring
+typedef struct _LToxThread {
+    pthread_t id;
+    int stop;
+    uint32_t next_id;
+    LToxCommand *slots;
+    uint32_t capacity;      // power of 2
+    uint32_t head;          // next command to run, written by the network thread
+    uint32_t tail;          // next slot to write, written by Lua
+} LToxThread;
+
+// a message waiting in a friend's outgoing queue
+typedef struct _LToxOutMsg {
+    struct _LToxOutMsg *next;
+    uint8_t *data;
+    uint32_t len;
+    uint32_t sent;          // bytes already sent, for split messages
+    int action;
+    int tagged;
+    double tag;             // handed to the receipt tracker
+} LToxOutMsg;
+
+typedef struct _LToxOutbox {
+    LToxOutMsg *head;
+    LToxOutMsg *tail;
+    uint32_t count;
+    uint32_t backoff;       // ms before the next retry after a failure
+    uint64_t retry_at;      // monotonic ns
+} LToxOutbox;
+
+#define RECEIPT_BUCKETS 24
+
+// delivery latencies, in log2 ms buckets
+typedef struct _LToxLatency {
+    uint32_t buckets[RECEIPT_BUCKETS];
+    uint32_t count;
+    uint32_t lost;          // swept before their read receipt came
+    uint32_t max;           // ms
+    double sum;             // ms
+} LToxLatency;
+
+typedef struct _LToxReceipt {
+    uint64_t key;           // friend number << 32 | receipt, 0 if free
+    uint64_t sent;          // monotonic ns
+    double tag;
+    int tagged;
+} LToxReceipt;
+
+typedef struct _LToxReceipts {
+    LToxReceipt *slots;     // open addressing, linear probing
+    uint32_t capacity;      // power of 2
+    uint32_t count;
+    LToxLatency global;
+    LToxLatency *friends;   // indexed by friend number
+    uint32_t nb_friends;
+} LToxReceipts;
+
+typedef struct _LToxFriendKey {
+    uint8_t id[TOX_CLIENT_ID_SIZE];
+    int32_t friendnumber;   // -1 if free
+} LToxFriendKey;
+
+// client id -> friend number
+typedef struct _LToxFriendIndex {
+    LToxFriendKey *slots;   // open addressing, linear probing
+    uint32_t capacity;      // power of 2
+    uint32_t count;
+    int stale;              // rebuilt from tox on the next lookup
+} LToxFriendIndex;
+
+// presence changes of a friend since the last poll
+#define PRESENCE_ONLINE         1
+#define PRESENCE_USER_STATUS    2
+#define PRESENCE_NAME           4
+#define PRESENCE_STATUS_MESSAGE 8
+
+typedef struct _LToxPresence {
+    uint8_t online;
+    uint8_t status;         // TOX_USERSTATUS
+    uint8_t changed;        // PRESENCE_*, 0 if not in the change list
+} LToxPresence;
+
+// background saves: Lua snapshots tox into the buffer the writer isn't using,
+// the writer thread persists the last snapshot taken
+typedef struct _LToxAutosave {
+    pthread_t id;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *path;
+    int sync;               // fsync each save
+    uint64_t interval;      // ns between snapshots
+    uint64_t last;          // monotonic ns of the last snapshot
+    uint8_t *buffers[2];
+    uint32_t sizes[2];
+    uint32_t capacities[2];
+    int ready;              // buffer waiting for the writer, -1 if none
+    int writing;            // buffer being written, -1 if none
+    int stop;
+    int error;              // errno of the last failed save, 0 if it succeeded
+    uint32_t saves;
+} LToxAutosave;
+
+// change log appended between full saves, replayed by loadFromFile
+typedef struct _LToxJournal {
+    int fd;
+    char *path;             // of the snapshot, the journal being path..".journal"
+    uint32_t records;       // appended since the last compaction
+    uint32_t unsynced;      // appended since the last fsync
+    uint32_t compact;       // records that trigger a compaction, 0 for never
+    uint64_t interval;      // ns between fsyncs, 0 to sync each record
+    uint64_t last_sync;     // monotonic ns, or of the last failed compaction
+    int failed;             // a record was lost, the journal is no longer appended to
+    uint32_t errors;        // failures since the journal was opened
+    int error;              // errno of the last failure, 0 if none
+} LToxJournal;
+
+// a burst of messages being coalesced
+typedef struct _LToxPending {
+    int32_t friendnumber;
+    uint32_t tick;          // tick of the first message
+    uint64_t deadline;      // monotonic ns
+} LToxPending;
+
+// a handler coroutine parked until its wake condition fires
+typedef struct _LToxTask {
+    lua_State *co;
+    int thread;             // luaL_ref of the coroutine
+    int until;              // luaL_ref of the wake predicate, LUA_NOREF if none
+    uint64_t wake;          // monotonic ns, 0 to resume on the next tick
+    int cb;                 // CB_* of the handler, for error reports
+} LToxTask;
+
 #define TOX_STR "Tox"
 typedef struct _LTox {
     Tox *tox;
-    callbacks_t callbacks;
+    lua_State *L;          // main thread of the state the instance belongs to
+    int callbacks[CB_MAX]; // luaL_ref of the handlers, LUA_NOREF if unset
+    int userdata[CB_MAX];  // luaL_ref of the values passed back to the handlers
+    int hooked[CB_MAX];    // C callback registered with toxcore
+    LToxEvents *events;    // batched delivery, NULL if disabled
+    int errors;            // luaL_ref of the queued callback errors
+    uint32_t nb_errors;
+    uint32_t max_errors;   // 0: callback errors are raised
+    uint32_t errors_dropped;
+    int coroutines;        // handlers run in coroutines
+    int resuming;          // parked handlers are being resumed
+    LToxTask *tasks;       // parked handlers
+    uint32_t nb_tasks;
+    uint32_t max_tasks;
+    LToxThread *thread;    // threaded engine, NULL if Lua drives tox_do
+    LToxOutbox *outboxes;  // outgoing queues, indexed by friend number
+    uint32_t nb_outboxes;
+    uint32_t queued;       // messages waiting in all queues
+    uint32_t max_queued;   // per friend
+    LToxReceipts *receipts; // receipt tracker, NULL if disabled
+    struct _LToxBuffer *receive; // file data buffer, NULL for strings
+    int receive_ref;
+    uint32_t ticks;        // tox_do calls driven by Lua
+    uint32_t coalesce_ticks; // window of coalesced messages, in ticks if not 0,
+    uint32_t coalesce_ms;    // in ms otherwise
+    int coalesced;         // luaL_ref of friendnumber -> messages, LUA_NOREF if disabled
+    LToxPending *pending;  // bursts being coalesced
+    uint32_t nb_pending;
+    uint32_t max_pending;
+    LToxFriendIndex index; // friend numbers by client id
+    LToxPresence *presence; // indexed by friend number
+    int32_t *changed;      // friends with pending presence changes, in order
+    uint32_t nb_presence;  // capacity of both
+    uint32_t nb_changed;
+    int dirty;             // state changed since the last autosave snapshot
+    LToxAutosave *autosave; // NULL if disabled
+    LToxJournal *journal;  // NULL if disabled
+    int busy;              // tox_do or its callbacks are running
+    int kill_pending;      // killed while busy, done once they return
 } LTox;
 
 int lua_tox_get_address(lua_State*);
 int lua_tox_add_friend(lua_State*);
 int lua_tox_add_friend_norequest(lua_State*);
+int lua_tox_add_friends_norequest(lua_State*);
 int lua_tox_get_friend_number(lua_State*);
 int lua_tox_get_client_id(lua_State*);
 int lua_tox_del_friend(lua_State*);
@@ -114,6 +278,14 @@ int lua_tox_get_friend_connection_status(lua_State*);
 int lua_tox_friend_exists(lua_State*);
 int lua_tox_send_message(lua_State*);
 int lua_tox_send_action(lua_State*);
+int lua_tox_broadcast_message(lua_State*);
+int lua_tox_queue_message(lua_State*);
+int lua_tox_queue_action(lua_State*);
+int lua_tox_queue_depth(lua_State*);
+int lua_tox_set_queue_limit(lua_State*);
+int lua_tox_track_receipts(lua_State*);
+int lua_tox_receipt_stats(lua_State*);
+int lua_tox_sweep_receipts(lua_State*);
 int lua_tox_set_name(lua_State*);
 int lua_tox_get_self_name(lua_State*);
 int lua_tox_get_name(lua_State*);
@@ -134,7 +306,21 @@ int lua_tox_get_is_typing(lua_State*);
 int lua_tox_count_friendlist(lua_State*);
 int lua_tox_get_num_online_friends(lua_State*);
 int lua_tox_get_friendlist(lua_State*);
+int lua_tox_friends(lua_State*);
+int lua_tox_get_friends_snapshot(lua_State*);
+int lua_tox_poll_presence_changes(lua_State*);
 
+int lua_tox_on(lua_State*);
+int lua_tox_batch_events(lua_State*);
+int lua_tox_drain_events(lua_State*);
+int lua_tox_isolate_errors(lua_State*);
+int lua_tox_errors(lua_State*);
+int lua_tox_use_coroutines(lua_State*);
+int lua_tox_receive_into(lua_State*);
+int lua_tox_coalesce_messages(lua_State*);
+int lua_tox_start_thread(lua_State*);
+int lua_tox_stop_thread(lua_State*);
+int lua_tox_post(lua_State*);
 int lua_tox_callback_friend_request(lua_State*);
 int lua_tox_callback_friend_message(lua_State*);
 int lua_tox_callback_friend_action(lua_State*);
@@ -181,9 +367,19 @@ int lua_tox_new(lua_State*);
 int lua_tox_kill(lua_State*);
 int lua_tox_do_interval(lua_State*);
 int lua_tox_do(lua_State*);
+int lua_tox_run(lua_State*);
+int lua_tox_run_all(lua_State*);
+int lua_tox_pollfds(lua_State*);
+int lua_tox_timeout(lua_State*);
 int lua_tox_size(lua_State*);
 int lua_tox_save(lua_State*);
 int lua_tox_load(lua_State*);
+int lua_tox_save_to_file(lua_State*);
+int lua_tox_load_from_file(lua_State*);
+int lua_tox_autosave(lua_State*);
+int lua_tox_autosave_status(lua_State*);
+int lua_tox_journal(lua_State*);
+int lua_tox_journal_status(lua_State*);
 
 #ifdef __cplusplus
 }
@@ -23,8 +23,10 @@
 
 #include <stdlib.h> // malloc
 #include <string.h> // memcpy
+#include <stdint.h> // uintptr_t
 
 #include "lua_toxav.h"
+#include "lua_buffer.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -74,7 +76,11 @@ static LTox *checkLTox(lua_State* L, int index) {
 }
 
 static LToxAv *pushToxAv(lua_State* L, Tox *tox, int32_t max_calls) {
+    lua_State *M = main_thread(L);
+    if(M == NULL)
+        luaL_error(L, "Main thread unknown, create the first instance from it.");
     LToxAv *lav = (LToxAv*)lua_newuserdata(L, sizeof(LToxAv));
+    lav->L = M;
     lav->av = toxav_new(tox, max_calls);
     lav->settings = av_DefaultSettings;
     if(lav->av==NULL) {
@@ -269,15 +275,18 @@ int getVADTolerence(lua_State *L) {
 typedef struct _lobj {
     lua_State *L;
     LToxAv *lav;
-    void *userdata;
-    size_t len;
+    int userdata; // luaL_ref, LUA_NOREF if none
 } LObj;
 
-LObj *createState(lua_State *L, LToxAv *lav, void *userdata, size_t len) {
+// userdata is the stack index of the value handed back to the callback, 0 if none
+LObj *createState(lua_State *L, LToxAv *lav, int userdata) {
     LObj *l = (LObj*)malloc(sizeof(LObj));
-    l->userdata = userdata;
+    l->userdata = LUA_NOREF;
     l->lav = lav;
-    l->len = len;
+    if(userdata && ! lua_isnoneornil(L, userdata)) {
+        lua_pushvalue(L, userdata);
+        l->userdata = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
 
     lua_pushlightuserdata(L, (void*)lav->av); // must exist, being registered with _new
     lua_gettable(L, LUA_REGISTRYINDEX);
@@ -297,8 +306,8 @@ LObj *createState(lua_State *L, LToxAv *lav, void *userdata, size_t len) {
     lua_pop(L,2); // table + registry
     return l;
 }
-LObj *storeState(lua_State *L, LToxAv *lav, void *userdata, size_t len) {
-    LObj *l = createState(L, lav, userdata, len);
+LObj *storeState(lua_State *L, LToxAv *lav, int userdata) {
+    LObj *l = createState(L, lav, userdata);
     lua_State *Lt = lua_newthread(L);
     lua_pop(L,1); // thread
     l->L = Lt;
@@ -328,9 +337,9 @@ void callback_OnInvite(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_invite) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnInvite", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnInvite", 0, 2);
     }
 }
 
@@ -338,9 +347,9 @@ void callback_OnStart(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_start) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnStart", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnStart", 0, 2);
     }
 }
 
@@ -348,9 +357,9 @@ void callback_OnCancel(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_cancel) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnCancel", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnCancel", 0, 2);
     }
 }
 
@@ -358,9 +367,9 @@ void callback_OnReject(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_reject) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnReject", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnReject", 0, 2);
     }
 }
 
@@ -368,9 +377,9 @@ void callback_OnEnd(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_end) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnEnd", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnEnd", 0, 2);
     }
 }
 
@@ -378,9 +387,9 @@ void callback_OnRinging(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_ringing) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnRinging", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnRinging", 0, 2);
     }
 }
 
@@ -388,9 +397,9 @@ void callback_OnStarting(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_starting) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnStarting", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnStarting", 0, 2);
     }
 }
 
@@ -398,9 +407,9 @@ void callback_OnEnding(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_ending) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnEnding", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnEnding", 0, 2);
     }
 }
 
@@ -408,9 +417,9 @@ void callback_OnRequestTimeout(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_request_timeout) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnRequestTimeout", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnRequestTimeout", 0, 2);
     }
 }
 
@@ -418,9 +427,9 @@ void callback_OnPeerTimeout(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_peer_timeout) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnPeerTimeout", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnPeerTimeout", 0, 2);
     }
 }
 
@@ -428,20 +437,16 @@ void callback_OnMediaChange(void *av, int32_t call_index, void *obj) {
     LObj *lobj = (LObj*)obj;
     LToxAv *lav = lobj->lav;
     if(lav->callbacks.on_media_change) {
-        lua_pushnumber(Ls, call_index);
-        lua_pushlstring(Ls, lobj->userdata, lobj->len);
-        call_cb(Ls, lav, "OnMediaChange", 0, 2);
+        lua_pushnumber(lav->L, call_index);
+        lua_rawgeti(lav->L, LUA_REGISTRYINDEX, lobj->userdata);
+        call_cb(lav->L, lav, "OnMediaChange", 0, 2);
     }
 }
 
 int lua_toxav_register_callstate_callback(lua_State* L) {
     LToxAv *lav = checkLToxAv(L,1);
     ToxAvCallbackID cb = (ToxAvCallbackID)luaL_checknumber(L,3);
-    size_t len = 0;
-    void *userdata = NULL;
-    if(! lua_isnoneornil(L,4))
-        userdata = (void*)lua_tolstring(L,4, &len);
-    LObj *lobj = createState(L, lav, userdata, len);
+    LObj *lobj = createState(L, lav, 4);
 
     switch(cb) {
         case av_OnInvite:
@@ -514,12 +519,11 @@ int lua_toxav_register_callstate_callback(lua_State* L) {
 void callback_OnAudioRecv(ToxAv *av, int32_t call_index, int16_t *data, int length, void *obj) {
     LObj *lobj = (LObj*)obj;
     lua_State *L = (lobj->L);
-    if(!L)
-        luaL_error(Ls, "OnAudioRecv: failed to get lua_State.");
-
     LToxAv *lav = lobj->lav;
-    if(!lav)
-        luaL_error(Ls, "internal error: Couldn't get LToxAv from registry.");
+    if(!lav) // no state to report to
+        return;
+    if(!L)
+        luaL_error(lav->L, "OnAudioRecv: failed to get lua_State.");
     
     if(lav->callbacks.on_audio_recv) {
         lua_pushnumber(L, call_index);
@@ -531,13 +535,8 @@ int lua_toxav_audio_recv_callback(lua_State *L) {
     LToxAv *lav = checkLToxAv(L,1);
     set(L, lav, "OnAudioRecv", 2);
 
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-
     // lua thread environment
-    LObj *lobj = storeState(L, lav, userdata, len);
+    LObj *lobj = storeState(L, lav, 3);
 
     toxav_register_audio_recv_callback(lav->av, callback_OnAudioRecv, lobj);
 
@@ -550,12 +549,11 @@ int lua_toxav_audio_recv_callback(lua_State *L) {
 void callback_OnVideoRecv(ToxAv *av, int32_t call_index, vpx_image_t *data, void *obj) {
     LObj *lobj = (LObj*)obj;
     lua_State *L = (lobj->L);
-    if(!L)
-        luaL_error(Ls, "OnVideoRecv: failed to get lua_State.");
-
     LToxAv *lav = lobj->lav;
-    if(!lav)
-        luaL_error(Ls, "internal error: Couldn't get LToxAv from registry.");
+    if(!lav) // no state to report to
+        return;
+    if(!L)
+        luaL_error(lav->L, "OnVideoRecv: failed to get lua_State.");
 
     if(lav->callbacks.on_video_recv) {
         lua_pushnumber(L, call_index);
@@ -566,13 +564,8 @@ int lua_toxav_video_recv_callback(lua_State *L) {
     LToxAv *lav = checkLToxAv(L,1);
     set(L, lav, "OnVideoRecv", 2);
 
-    size_t len = 0;
-    void *userdata = NULL;
-    if( ! lua_isnoneornil(L,3) )
-        userdata = (void*)lua_tolstring(L,3, &len);
-
     // lua thread environment
-    LObj *lobj = storeState(L, lav, userdata, len);
+    LObj *lobj = storeState(L, lav, 3);
 
     toxav_register_video_recv_callback(lav->av, callback_OnVideoRecv, lobj);
 
@@ -828,6 +821,20 @@ int lua_toxav_prepare_audio_frame(lua_State* L) {
     int payload_size = luaL_checknumber(L,3);
     //int16_t *frame = (int16_t*)lua_touserdata(L,4);
 
+    LToxBuffer *b = test_buffer(L,4);
+    if(b) { // used in place
+        if(b->len < handle->frame_size * sizeof(int16_t))
+            return luaL_argerror(L, 4, "buffer shorter than a frame");
+        if((uintptr_t)b->data % sizeof(int16_t)) // e.g. a slice starting at an odd byte offset
+            return luaL_argerror(L, 4, "buffer not aligned on 16 bits samples");
+        int r = toxav_prepare_audio_frame(av, handle->call_index,
+                                            handle->payload, payload_size, (int16_t*)b->data, handle->frame_size);
+        lua_settop(L,0);
+        if(r<=0)
+            return throw_error(L, r);
+        lua_pushnumber(L, r);
+        return 1;
+    }
     if(lua_type(L,4) == LUA_TUSERDATA) {
         handle->frame = (int16_t*)lua_touserdata(L,4);
 
@@ -925,6 +932,20 @@ int lua_toxav_get_tox(lua_State* L) {
     return 0;
 }
 
+// toxav has no socket of its own, its traffic goes through the Tox instance
+int lua_toxav_pollfds(lua_State* L) {
+    LToxAv *lav = checkLToxAv(L,1);
+    lua_settop(L,0);
+    return push_pollfds(L, lav->tox);
+}
+
+int lua_toxav_timeout(lua_State* L) {
+    LToxAv *lav = checkLToxAv(L,1);
+    lua_settop(L,0);
+    lua_pushnumber(L, tox_do_interval(lav->tox));
+    return 1;
+}
+
 /************************************
  *                                  *
  * lua module loader and destructor *
@@ -966,8 +987,10 @@ int lua_toxav_gc(lua_State* L) {
             lua_pushnil(L);
             while(lua_next(L, -2)) {
                 LObj *obj = (LObj*)lua_topointer(L,-1);
-                if(obj)
+                if(obj) {
+                    luaL_unref(L, LUA_REGISTRYINDEX, obj->userdata);
                     free(obj);
+                }
                 lua_pushnil(L);
                 lua_rawset(L, -4);
             }
@@ -1009,6 +1032,7 @@ int lua_toxav_new(lua_State* L) {
     lua_settop(L,0);
     Tox *tox = ltox->tox;
     LToxAv *lav = pushToxAv(L, tox, max_calls);
+    lav->tox = tox;
     
     lav->max_calls = max_calls;
     lav->calls = (Call*)calloc(max_calls, sizeof(Call));
@@ -1039,6 +1063,7 @@ int lua_toxav_new_self(lua_State* L) {
 // TODO: improve: set methods only when new is called
 static const luaL_Reg toxav_methods[] = {
     {"new", lua_toxav_new},
+    {"buffer", lua_buffer_new},
 
     {"getSettings", getSettings},
     {"getVideoBitrate", getVideoBitrate},
@@ -1070,6 +1095,9 @@ static const luaL_Reg toxav_methods[] = {
 
     {"getCallState", lua_toxav_get_call_state},
 
+    {"pollfds", lua_toxav_pollfds},
+    {"timeout", lua_toxav_timeout},
+
     {"registerCallback", lua_toxav_register_callstate_callback},
     {"registerRecvAudio", lua_toxav_audio_recv_callback},
     {"registerRecvVideo", lua_toxav_video_recv_callback},
@@ -1092,7 +1120,8 @@ static const luaL_Reg class_meta[] = {
 };
 
 int lua_toxav_register(lua_State* L) {
-    Ls = L;
+    main_thread(L); // keep the main thread while we're most likely running on it
+    register_buffer(L);
     lua_newtable(L);
     for(int f = 0; toxav_methods[f].name != NULL; ++f) {
         lua_pushstring(L, toxav_methods[f].name);
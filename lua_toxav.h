@@ -58,6 +58,8 @@ typedef struct _LTox {
 struct _Call;
 typedef struct _LToxAv {
     ToxAv *av;
+    Tox *tox;
+    lua_State *L;           // main thread of the state the instance belongs to
     int max_calls;
     ToxAvCSettings settings;
     struct _Call *calls;
@@ -131,5 +133,7 @@ int lua_toxav_get_call_state(lua_State*);
 int lua_toxav_change_settings(lua_State*);
 
 int lua_toxav_get_tox(lua_State*);
+int lua_toxav_pollfds(lua_State*);
+int lua_toxav_timeout(lua_State*);
 
 #endif /* LUA_TOXAV_H */
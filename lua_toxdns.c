@@ -28,6 +28,7 @@
 
 #include "tox/tox.h"
 #include "lua_toxdns.h"
+#include "lua_buffer.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -96,7 +97,7 @@ int lua_tox_generate_dns3_string(lua_State* L) {
     ToxDNS *toxDNS = checkToxDNS(L,1);
     size_t len;
     const char *host = luaL_checkstring(L,2);
-    uint8_t *name = (uint8_t*)luaL_checklstring(L,3,&len);
+    uint8_t *name = (uint8_t*)check_data(L, 3, &len);
     uint8_t res[1024] = {0};
     uint32_t req;
     int status = tox_generate_dns3_string(toxDNS->dns, res + 1 , sizeof(res) - 1, &req, name, len);
@@ -132,7 +133,7 @@ int lua_tox_decrypt_dns3_TXT(lua_State* L) {
     uint32_t id = luaL_checknumber(L,2);
 
     size_t len;
-    uint8_t *request = (uint8_t*)luaL_checklstring(L, 3, &len);
+    uint8_t *request = (uint8_t*)check_data(L, 3, &len);
 
     uint8_t tox_id[TOX_FRIEND_ADDRESS_SIZE];
     
@@ -201,6 +202,7 @@ int lua_toxdns_new_self(lua_State* L) {
 // TODO: improve: set methods only when new is called
 static const luaL_Reg toxdns_methods[] = {
     {"new", lua_toxdns_new},
+    {"buffer", lua_buffer_new},
 
     {"generate", lua_tox_generate_dns3_string},
     {"decrypt", lua_tox_decrypt_dns3_TXT},
@@ -221,7 +223,8 @@ static const luaL_Reg class_meta[] = {
 };
 
 int lua_toxdns_register(lua_State* L) {
-    Ls = L;
+    main_thread(L); // keep the main thread while we're most likely running on it
+    register_buffer(L);
     lua_newtable(L);
     // lua 5.2's luaL_setfuncs light emulation
     for(int f = 0; toxdns_methods[f].name != NULL; ++f) {
@@ -9,18 +9,6 @@
 --
 
 local tox = require("tox")
-local posix = require("posix")
-
-
-local function load_boostrap_data(fname)
-    local fp = io.open(fname, "rb")
-    if not fp then
-        return nil
-    end
-    local data = fp:read("*a")
-    fp:close()
-    return data
-end
 
 
 local function run(datadir)
@@ -30,15 +18,12 @@ local function run(datadir)
     end
 
     local bootstrap_file = datadir .. "/data"
-    local bootstrap_data = load_boostrap_data(bootstrap_file)
-    if not bootstrap_data then
-        print("No bootstrap data found in " .. bootstrap_file)
+    local ok, t = pcall(tox.new, { load_file = bootstrap_file })
+    if not ok then
+        print("No bootstrap data found in " .. bootstrap_file .. " (" .. t .. ")")
         return
     end
 
-    local t = tox.new()
-    t:load(bootstrap_data)
-
     -- Accepts friend requests automatically.
     t:callbackFriendRequest(function(pub, msg, userdata)
         print("Friend request received: " .. (msg or "No message"))
@@ -56,7 +41,7 @@ local function run(datadir)
 
     print("Waiting for connection...")
     local echoed = false
-    while true do
+    t:run{ ["until"] = function()
         if t:isConnected() then
             if not echoed then
                 print("Connected")
@@ -66,9 +51,8 @@ local function run(datadir)
             print("Disconnected")
             echoed = false
         end
-        t:toxDo()
-        posix.sleep(1)
-    end
+        return false
+    end }
 
 end
 
@@ -74,8 +74,88 @@ local function test_init_w_args()
     print "PASSED: init with options"
 end
 
+local function test_run()
+    local n = tox:run{ maxIterations = 3 }
+    assert( n == 3, string.format("FAILED: run: expected 3 iterations, got %s", tostring(n)) )
+
+    local calls = 0
+    n = tox:run{ ["until"] = function() calls = calls + 1; return calls == 2 end }
+    assert( n == 2, string.format("FAILED: run until: expected 2 iterations, got %s", tostring(n)) )
+    local timeout = tox:timeout()
+    assert( timeout >= 0 and timeout <= 1000, "FAILED: timeout: "..tostring(timeout) )
+    print "PASSED: run"
+
+    n = Tox.runAll({ tox, tox2, tox3 }, { maxIterations = 3 })
+    assert( n == 3, string.format("FAILED: runAll: expected 3 iterations, got %s", tostring(n)) )
+    print "PASSED: runAll"
+end
+
+local function test_buffer()
+    local buf = Tox.buffer(16)
+    assert(buf:capacity() == 16 and #buf == 0, "FAILED: buffer: new")
+    assert(buf:write("hello world") == 11, "FAILED: buffer: write")
+    assert(buf:write("!!!!!!!!") == nil, "FAILED: buffer: write past capacity")
+    local s = buf:slice(7)
+    assert(tostring(s) == "world", "FAILED: buffer: slice")
+    s:write("W", 1)
+    assert(buf:tostring(1, 7) == "hello W", "FAILED: buffer: slice doesn't share memory")
+    assert(buf.__gc == nil, "FAILED: buffer: __gc reachable as a method")
+
+    local state = Tox.buffer(tox:size())
+    assert(tox:save(state) == state and #state == tox:size(), "FAILED: buffer: save into buffer")
+    print "PASSED: buffer"
+end
+
+local function test_save_to_file()
+    local path = os.tmpname()
+    assert(tox:saveToFile(path, { fsync = true }), "FAILED: saveToFile")
+    local f = assert(io.open(path, "rb"))
+    local data = f:read("*a")
+    f:close()
+    assert(data == tox:save(), "FAILED: saveToFile: content")
+
+    local t = Tox()
+    assert(t:loadFromFile(path), "FAILED: loadFromFile")
+    assert(t:getAddress() == tox:getAddress(), "FAILED: loadFromFile: identity")
+    t:kill()
+    t = Tox{ load_file = path }
+    assert(t:getAddress() == tox:getAddress(), "FAILED: load_file option")
+    t:kill()
+    assert(tox:loadFromFile("/nonexistent/tox.save") == nil, "FAILED: loadFromFile: bad path")
+    assert(tox:saveToFile("/nonexistent/dir/tox.save") == nil, "FAILED: saveToFile: bad path")
+
+    t = Tox()
+    assert(t:autosave(path, { interval = 0 }), "FAILED: autosave")
+    assert(t:setName("autosave"), "FAILED: autosave: setName")
+    t:toxDo()
+    assert(t:autosaveStatus(), "FAILED: autosaveStatus")
+    assert(t:autosave(false), "FAILED: autosave: stop")
+    f = assert(io.open(path, "rb"))
+    data = f:read("*a")
+    f:close()
+    assert(data == t:save(), "FAILED: autosave: content")
+    t:kill()
+
+    t = Tox()
+    assert(t:journal(path, { syncInterval = 0 }), "FAILED: journal")
+    assert(t:setName("journal"), "FAILED: journal: setName")
+    assert(t:addFriendNorequest(tox:getAddress():sub(1, 32)), "FAILED: journal: addFriendNorequest")
+    local status = t:journalStatus()
+    assert(status.records == 2 and not status.failed and status.errors == 0, "FAILED: journalStatus")
+    assert(t:autosave(path) == nil, "FAILED: autosave accepted on the journal's path")
+    assert(t:journal(false), "FAILED: journal: close")
+    t:kill()
+    t = Tox{ load_file = path }
+    assert(t:getSelfName() == "journal" and t:countFriendlist() == 1, "FAILED: journal: replay")
+    t:kill()
+    os.remove(path..".journal")
+    os.remove(path)
+    print "PASSED: save to file"
+end
+
 local function accept_friend_request(pub, data, userdata)
-    print("to compare: '"..(userdata or "nil").."'", #userdata)
+    print("to compare: '"..(userdata or "nil").."'", type(userdata))
+    assert( userdata == to_compare, "FAILED: userdata not passed back as is" )
     if (#data == 6) and ("Gentoo"==data) then
         local req, err = tox2:addFriendNorequest(pub)
         if not(req)then
@@ -150,6 +230,173 @@ local function test_send_message()
         os.execute("sleep 1")
     end
     print("PASSED: send/receive message")
+
+    local long = string.rep("\195\169t\195\169 ", 1000) -- "été ", 2 bytes characters
+    local receipts, err = tox2:sendAction(0, long)
+    assert(type(receipts)=="table", "FAILED: send long action: "..tostring(err))
+    assert(#receipts > 1, string.format("FAILED: send long action: unexpected number of chunks: %d", #receipts))
+    print("PASSED: send long action")
+
+    local sent, count = tox2:broadcastMessage("online", "B", true)
+    assert(count == 1 and sent[0], "FAILED: broadcast action to online friends")
+    sent, count = tox2:broadcastMessage({ 0, 42 }, "B", true)
+    assert(count == 1 and sent[0] and sent[42] == false, "FAILED: broadcast action to friend list")
+    sent, count = tox2:broadcastMessage({ 42, 0 }, long, true)
+    assert(count == 1 and sent[42] == false and type(sent[0]) == "table",
+        "FAILED: long broadcast with a failing recipient")
+    assert(not pcall(tox2.broadcastMessage, tox2, { 0, "x" }, "B", true),
+        "FAILED: broadcast to a bad target")
+    print("PASSED: broadcast")
+
+    assert(tox2:queueAction(0, "Q") == 0, "FAILED: queued action not sent to online friend")
+    assert(tox2:queueAction(42, "Q") == nil, "FAILED: queued action for unknown friend")
+    assert(tox2:queueDepth() == 0, "FAILED: queue depth")
+    assert(not pcall(tox2.setQueueLimit, tox2, 0), "FAILED: queue limit of 0 accepted")
+    assert(tox2:queueAction(0, "Q", 3) == 0, "FAILED: tagged queued action")
+    print("PASSED: queue")
+
+    local tag = nil
+    assert(tox2:trackReceipts(), "FAILED: trackReceipts")
+    tox2:callbackReadReceipt(function(friendnumber, receipt, userdata, latency, t)
+        assert(latency, "FAILED: read receipt without latency")
+        tag = t
+    end)
+    assert(tox2:sendMessage(0, "G", 7), "FAILED: send tagged message")
+    while not(tag) do
+        tox:toxDo()
+        tox2:toxDo()
+        tox3:toxDo()
+        os.execute("sleep 0.1")
+    end
+    assert(tag == 7, "FAILED: tag not passed back with the read receipt")
+    local stats = tox2:receiptStats()
+    assert(stats.count >= 1 and stats.histogram and stats.pending >= 0, "FAILED: receipt stats")
+    assert(not pcall(tox2.sweepReceipts, tox2, -1), "FAILED: sweepReceipts: negative timeout")
+    tox2:callbackReadReceipt(nil)
+    tox2:trackReceipts(false)
+    print("PASSED: receipt tracker")
+end
+
+local function test_yield_message()
+    print"******** YIELD IN CALLBACK ********"
+
+    local stage = 0
+    local function wait_message(friendnumber, string, userdata)
+        stage = 1
+        coroutine.yield(10)
+        stage = 2
+        coroutine.yield(function() return true end)
+        stage = 3
+    end
+
+    tox3:useCoroutines(true)
+    tox3:callbackFriendMessage(wait_message, to_compare)
+    assert(tox2:sendMessage(0, "Y"), "FAILED: Friend doesn't exist!" )
+
+    while stage < 3 do
+        tox:toxDo()
+        tox2:toxDo()
+        tox3:toxDo()
+        os.execute("sleep 0.1")
+    end
+    tox3:useCoroutines(false)
+    print("PASSED: yield in callback")
+end
+
+local function test_thread()
+    print"******** NETWORK THREAD ********"
+
+    local received = nil
+    tox3:callbackFriendMessage(function(friendnumber, string, userdata)
+        received = received or ("T"==string)
+    end)
+
+    assert(tox2:startThread{ commands = 10 }, "FAILED: startThread")
+    local id = assert(tox2:post("sendMessage", 0, "T"), "FAILED: post")
+    local long_id = assert(tox2:post("sendMessage", 0, string.rep("L", 3000)), "FAILED: post: long message")
+    local result, long_result = nil, nil
+    while not(received and result and long_result) do
+        tox:toxDo()
+        tox3:toxDo()
+        for _, ev in ipairs(tox2:drainEvents()) do
+            if ev[1] == "command" and ev[2] == id then
+                assert(ev[3] == "sendMessage", "FAILED: command name not passed back")
+                result = ev[4]
+            elseif ev[1] == "command" and ev[2] == long_id then
+                long_result = ev[4]
+            end
+        end
+        os.execute("sleep 0.1")
+    end
+    assert(tox2:stopThread(), "FAILED: stopThread")
+    tox2:batchEvents(false)
+    assert(result > 0, "FAILED: sendMessage from the network thread")
+    assert(long_result > 0, "FAILED: long sendMessage from the network thread")
+    print("PASSED: network thread")
+end
+
+local function test_coalesce()
+    print"******** COALESCED MESSAGES ********"
+
+    local received, calls = 0, 0
+    tox3:callbackFriendMessage(function(friendnumber, messages, userdata)
+        assert(type(messages)=="table", "FAILED: coalesced messages not passed as an array")
+        calls = calls + 1
+        received = received + #messages
+    end)
+    assert(tox3:coalesceMessages{ ms = 500 }, "FAILED: coalesceMessages")
+    for i = 1, 3 do
+        assert(tox2:sendMessage(0, "C"..i), "FAILED: send message")
+    end
+    while received < 3 do
+        tox:toxDo()
+        tox2:toxDo()
+        tox3:toxDo()
+        os.execute("sleep 0.1")
+    end
+    tox3:coalesceMessages(false)
+    assert(calls < 3, "FAILED: messages weren't coalesced")
+    print("PASSED: coalesced messages")
+end
+
+local function test_snapshot()
+    local snap = tox2:getFriendsSnapshot{ "online", "clientId" }
+    assert(#snap == 1 and snap[1].friend == 0, "FAILED: snapshot: friend list")
+    assert(snap[1].online == true and #snap[1].clientId == 32 and snap[1].name == nil,
+        "FAILED: snapshot: fields")
+    print("PASSED: friends snapshot")
+
+    local list = tox2:getFriendlist()
+    assert(#list == 1 and list[1] == 0, "FAILED: getFriendlist")
+    local seen = {}
+    for friendnumber in tox2:friends() do
+        seen[#seen+1] = friendnumber
+    end
+    assert(#seen == 1 and seen[1] == 0, "FAILED: friends iterator")
+    print("PASSED: friends iterator")
+
+    assert(tox2:getFriendNumber(snap[1].clientId) == 0, "FAILED: getFriendNumber")
+    assert(tox2:getFriendNumber(string.rep("\0", 32)) == nil, "FAILED: getFriendNumber: unknown key")
+    print("PASSED: friend index")
+
+    local changes = tox2:pollPresenceChanges()
+    assert(#changes >= 1 and changes[1].friend == 0 and changes[1].online == true
+        and changes[1].changed.online, "FAILED: presence changes")
+    assert(#tox2:pollPresenceChanges() == 0, "FAILED: presence changes not reset")
+    print("PASSED: presence changes")
+end
+
+local function test_bulk_friends()
+    local t = assert(Tox(), "FAILED: bulk friends: new instance")
+    local id1 = tox:getAddress():sub(1, 32)
+    local id2 = tox2:getAddress():sub(1, 32)
+    local r, added = t:addFriendsNorequest(id1..id2..id1)
+    assert(added == 2 and #r == 3, "FAILED: bulk friends: count")
+    assert(r[1] == 0 and r[2] == 1 and r[3] < 0, "FAILED: bulk friends: results")
+    assert(t:getFriendNumber(id2) == 1, "FAILED: bulk friends: index")
+    assert(t:addFriendsNorequest("short") == nil, "FAILED: bulk friends: bad length")
+    t:kill()
+    print("PASSED: bulk friends")
 end
 
 local function test_name_change()
@@ -432,9 +679,17 @@ test_init_wo_args()
 test_init_w_args()
 
 test_init()
+test_run()
+test_buffer()
+test_save_to_file()
 
 test_add_friends()
 test_send_message()
+test_yield_message()
+test_thread()
+test_coalesce()
+test_snapshot()
+test_bulk_friends()
 test_name_change()
 test_is_typing()
 test_send_file()